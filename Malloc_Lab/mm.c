@@ -14,11 +14,14 @@ If you found this file helpful, please consider reaching out to me:
  * 
  *      31                     3  2  1  0 
  *      -----------------------------------
- *     | s  s  s  s  ... s  s  s  0  0  a/f
+ *     | s  s  s  s  ... s  s  s  0  z  a/f
  *      ----------------------------------- 
  * 
  * where s are the meaningful size bits and a/f is set 
- * iff the block is allocated. The list has the following form:
+ * iff the block is allocated. z is set only in free blocks whose payload
+ * is known to be all zero (see KNOWN-ZERO BLOCKS); in allocated blocks the
+ * same bit is the collector's mark, and is only ever set during mm_gc
+ * (see GARBAGE COLLECTION). The list has the following form:
  *
  * begin                                                          end
  * heap                                                           heap  
@@ -46,15 +49,219 @@ If you found this file helpful, please consider reaching out to me:
  *NOTE: because of selected traces, setting next_fit_ptr = last coalesced
  *block in coalesce and setting next_fit_ptr = heap_listp instead of wrapping
  *in find_fit resulted in better score than with above opts
+ *
+ * CACHE LINE ISOLATION
+ * With MM_CACHELINE (per call via mm_malloc_flags, or heap-wide via
+ * mm_set_flags) the payload starts on a cache line boundary and is
+ * rounded up to whole lines, plus one doubleword for the footer and the
+ * next header. No other block's payload can then share a line with it,
+ * so objects handed to different threads do not false-share.
+ *
+ * ADAPTIVE HEAP GROWTH
+ * When no fit is found the heap grows by MAX(asize, chunksize). chunksize
+ * starts at CHUNKSIZE, doubles (up to MAXCHUNK) when the heap had to grow
+ * again within GROW_FAST mallocs, and halves (down to MINCHUNK) when
+ * GROW_SLOW mallocs went by without growth. MM_FIXED_CHUNK restores the
+ * fixed CHUNKSIZE growth, and MM_PREFAULT faults in every new chunk
+ * up front so page faults land in extend_heap instead of in user code.
+ *
+ * PAGE MAP MODE
+ * With MM_PAGEMAP, requests up to PM_MAXSMALL bytes are served from spans:
+ * page-aligned runs of PM_SPAN bytes carved into objects of one size
+ * class, with no boundary tags. Each span is itself one allocated block;
+ * its descriptor (object size and a bitmap of free slots) sits right
+ * after the objects, in the same block, and shares its last page with the
+ * next block. A two-level radix tree indexed by page number maps every
+ * object page to its span, so mm_free finds the size class and flips a
+ * bit in the descriptor without reading or writing the object's cache
+ * line. Overruns between objects hit no metadata, but one past the last
+ * object of a span lands in the descriptor, as one past an ordinary
+ * block lands in its footer. A span that empties is returned to the heap
+ * unless it is the last span with free objects in its class.
+ *
+ * SEGREGATED FREE LISTS
+ * Free blocks are also kept on SEG_LISTS explicit doubly linked lists, one
+ * per power-of-two size range, with the links stored in the first payload
+ * bytes of each free block. The links are 32-bit offsets from the start
+ * of the heap (0 ends a list), so two of them fit in the 8 payload bytes
+ * of a minimum block and the minimum block stays at 16 bytes; 64-bit
+ * pointers would need 24. Building with -DMM_WIDE_LINKS stores plain
+ * pointers instead, to measure the difference. Blocks go on the front of
+ * their list when they are freed or split off, and come off it when
+ * placed or merged.
+ *
+ * SIZE CLASSES
+ * Every malloc turns the request into a block size, and every placement,
+ * free and merge turns a block size into a free list index. Up to
+ * SMALL_MAX bytes both come from tables built once by class_init, one
+ * load each, indexed by the size in doublewords; larger sizes round with
+ * a mask and take the list index from a count of leading zeros, with no
+ * division or loop on either path. mm_realloc uses the same block size
+ * to keep a block in place when the new size rounds to the block it
+ * already has. Building with -DMM_CLASS_ARITH computes the small sizes
+ * arithmetically too, to measure the tables (mmbench -C).
+ *
+ * PLACEMENT POLICIES
+ * mm_set_policy picks how find_fit chooses among free blocks: next fit
+ * (the default, as above), first fit, best fit, good fit (the smallest of
+ * the first K blocks that fit) or address-ordered first fit. First, best
+ * and good fit search the segregated lists, starting with the size range
+ * of the request; next fit and address-ordered first fit walk the implicit
+ * list, which is in address order.
+ *
+ * LIFETIME REGIONS
+ * mm_malloc_hint places a block by its expected lifetime. Each lifetime
+ * class grows its own regions of the heap: when a class needs more memory
+ * and the top of the heap belongs to another class, extend_heap starts a
+ * new region behind a fence, an allocated 8-byte block like the prologue,
+ * so blocks never coalesce across regions. A sorted table of region starts
+ * gives the class of any address. Each class has its own segregated free
+ * lists and is only ever placed from them (next fit and AOFF, which walk
+ * the mixed implicit list, fall back to first fit on the class's lists
+ * once regions are in use). Short-lived objects then free whole regions
+ * instead of leaving holes between long-lived ones, and mm_trim can hand
+ * those regions' pages back with MADV_DONTNEED.
+ *
+ * With MM_LIFETIME, mm_malloc predicts the class itself from its call
+ * site. One in LIFE_RATE calls per site is sampled; when the object is
+ * freed its age in mallocs is recorded as short (under LIFE_SHORT) or
+ * long, and a site whose samples are mostly short allocates short-lived.
+ * Samples still live when their slot is needed count as long. Sites are
+ * remembered across mm_init, samples are not.
+ *
+ * INCREMENTAL VERIFICATION
+ * mm_checkheap walks the whole heap. With mm_set_verify(budget, period)
+ * every period'th mm_malloc or mm_free instead checks the next budget
+ * blocks after a rotating cursor (tags, alignment, size, that no two free
+ * blocks touch, that a free block's neighbours on its free list point
+ * back at it), and the first budget blocks of the free list the call
+ * touches. The cursor wraps at the epilogue, so a heap of n blocks is
+ * swept every n*period/budget calls; coalesce moves the cursor off blocks
+ * it merges away. Problems are counted, not printed, and read with
+ * mm_verify_errors. Checking every call costs a third or more of the
+ * allocator's time even at budget 1; the default period, VERIFY_PERIOD,
+ * brings that under the run-to-run noise of a timing run.
+ *
+ * HEAP LIMITS
+ * mm_set_limits caps the heap size (what mem_sbrk has handed out, which
+ * bounds the heap's resident memory). When a malloc finds no fit and
+ * growing the heap would pass the soft limit, relieve sheds memory before
+ * growing: it runs the callbacks registered with mm_on_pressure (mm_mag
+ * flushes its thread caches, mm_lf and mm_bg empty their pools and
+ * deferred frees, applications drop cache entries), then trims, and the
+ * malloc looks for a fit again. Past the soft limit the heap grows only by
+ * what each request needs, and relief reruns after every further
+ * soft/PRESSURE_STEPS bytes of growth rather than on every malloc, or
+ * whenever the alternative is failing at the hard limit. extend_heap
+ * refuses to pass the hard limit, so the malloc then returns NULL.
+ * The callbacks free into mm.c and take mm_lock, so they never run in the
+ * middle of a change to the heap: a malloc made under mm_lock (as every
+ * layer's are) or by mm.c for itself (a page map leaf or a span) only
+ * owes relief, and this thread pays it in mm_unlock, once the lock is
+ * released, or without mm_lock at the next malloc that finds no fit.
+ * mm_unlock returns 1 when it paid, and the layers then retry a malloc
+ * that failed, so relief still comes before the hard limit fails one.
+ *
+ * IN-PLACE REALLOC
+ * mm_realloc resizes a block where it is when it can. A shrink splits the
+ * tail off as a free block if it is big enough to stand alone. A growth
+ * absorbs a free successor if that is big enough, or, for the last block
+ * of the heap, extends the heap under it; only otherwise does the block
+ * move. With MM_REALLOC_GROW, blocks that keep growing are over-reserved:
+ * a growth tags the block GROWN (in the header and footer, a bit that
+ * free and place clear), and a tagged block that has to grow again takes
+ * twice its old size (at most GROW_MAXSLACK more than asked), so that
+ * later growths land in its own slack; a tagged block that shrinks keeps
+ * its slack. mm_get_stats counts reallocs, moves and bytes copied.
+ * Callers can do the same themselves: mm_usable_size reports the payload
+ * a block really has (place leaves remainders under MIN_BLOCK in it, and
+ * sizes round up), and mm_try_expand grows a block only where it is.
+ *
+ * GARBAGE COLLECTION
+ * mm_gc is a conservative mark-sweep collector for callers that leak. A
+ * root is any word of the calling thread's stack and registers (spilled
+ * there by setjmp and __builtin_unwind_init), of the program's data and
+ * bss, or of a range added with mm_gc_add_root. Any word that points into
+ * the payload of an allocated block, anywhere in it, marks the block, and
+ * marked blocks are scanned the same way. To map words to blocks, gc_index
+ * lists the allocated blocks in address order, as the implicit list walk
+ * finds them, in scratch memory mapped for the collection only; the mark
+ * is the z bit of the header. The sweep walks the implicit list again and
+ * hands every unmarked block to mm_free, which coalesces it as usual.
+ * mm.c's own pointers into the heap (next fit, the verifier's cursor,
+ * the zero high water mark, region starts, lifetime samples) are not
+ * roots. With MM_GC a collection
+ * runs before the heap grows, once place has handed out gc_next bytes
+ * since the last one: GC_GROWTH - 1 times the bytes that one kept (at
+ * least GC_MIN), so a collection comes when the heap would have grown
+ * GC_GROWTH times over were nothing freed. Counting the heap size instead
+ * would not do: it never shrinks, so once past the mark every miss (every
+ * wrap of the next fit rover) would collect.
+ *
+ * Only the calling thread's stack is scanned, so this is for
+ * single-threaded use, and pointers kept in other allocators' memory
+ * (libc's heap, thread-local storage, shared libraries) are not seen
+ * unless added as roots. Span objects (MM_PAGEMAP) are not collected
+ * one by one; a span lives as long as the page map, which is a root.
+ *
+ * LATENCY HISTOGRAMS
+ * With MM_LATENCY, mm_malloc times each call that goes to the free lists
+ * (not span objects or cache line blocks) with the time stamp counter,
+ * from classifying the size to returning, and counts the blocks find_fit
+ * looks at. Both go into log2 histograms for the call's size class, the
+ * free list its block size maps to, so that a placement policy that
+ * sometimes walks thousands of blocks shows up in the tail of one class
+ * rather than vanishing into an average. mm_get_latency copies them out;
+ * mm_dump_latency prints percentiles and the nonzero bins. mm_init clears
+ * them. The visit count is kept whether or not the flag is set; it is an
+ * increment in loops that already load each block's header.
+ *
+ * HEAP ANALYSIS
+ * mm_heap_analyze walks the block list the way mm_checkheap does and
+ * totals allocated and free bytes, bins free blocks by log2 of their
+ * size, and finds the largest. The fragmentation index is 1 - largest
+ * free / all free: 0 when the free space is one block, near 1 when no
+ * block holds much of it. Given a file name it also writes a heap map,
+ * the heap as alternating runs of allocated and free bytes (see
+ * mm_ext.h); mmheapmap draws it. Tags, fences and span pages count as
+ * allocated, so the runs add up to the heap size.
+ *
+ * HUGE PAGE MODE
+ * With MM_HUGEPAGE every heap extension is sized so the heap ends on a
+ * HUGEPAGE boundary, and the whole huge pages it adds are madvised for
+ * transparent huge pages, so the heap grows in 2MB-aligned units. Small
+ * blocks (up to HP_SMALL) are placed first fit from the bottom of the
+ * heap rather than by the policy, which packs the many small, typically
+ * long-lived objects densely into the first few huge pages instead of
+ * spreading them over all of them. Anything that releases heap memory
+ * must do so in whole huge pages in this mode.
+ *
+ * KNOWN-ZERO BLOCKS
+ * mm_calloc skips the memset when the block it got is known to be zero.
+ * memlib's heap is one fresh anonymous mapping, so every byte above the
+ * highest address mem_sbrk has ever returned (zero_hwm) is still zero;
+ * mem_reset_brk keeps the mapping, so zero_hwm survives mm_init unless the
+ * heap itself moved (mem_deinit/mem_init). extend_heap sets z on a chunk
+ * that lies wholly above zero_hwm. place keeps z on the remainder of a
+ * split, since only the front of the block was handed out, and coalesce
+ * keeps it when every merged block had it, clearing the tags and list
+ * links that become payload. The links of the block itself are not zero,
+ * so mm_calloc still clears the first doubleword. mm_free clears z.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include "mm.h"
 #include "memlib.h"
+#include "mm_ext.h"
 #include <stdint.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <time.h>
 
 /* Your info */
 team_t team = { 
@@ -69,9 +276,46 @@ team_t team = {
 #define WSIZE       4       /* word size (bytes) */  
 #define DSIZE       8       /* doubleword size (bytes) */
 #define CHUNKSIZE  (1<<16)  /* initial heap size (bytes) */
+#define MINCHUNK   (1<<12)  /* smallest adaptive growth unit (bytes) */
+#define MAXCHUNK   (1<<20)  /* largest adaptive growth unit (bytes) */
+#define GROW_FAST  64       /* mallocs between growths that double chunksize */
+#define GROW_SLOW  (1<<14)  /* mallocs between growths that halve chunksize */
 #define OVERHEAD    8       /* overhead of header and footer (bytes) */
+#define CACHELINE   64      /* cache line size (bytes) */
+#define HUGEPAGE   (1<<21)  /* transparent huge page size (bytes) */
+#define HP_SMALL    256     /* blocks packed low in huge page mode (bytes) */
+#define GOOD_K      8       /* default good fit candidates */
+#define MAX_PRESSURE   16   /* pressure callbacks */
+#define PRESSURE_STEPS 16   /* rerun relief every soft/PRESSURE_STEPS bytes */
+#define GC_MIN     (1<<20)  /* bytes placed before an MM_GC collection */
+#define GC_GROWTH   2       /* heap growth factor between collections */
+#define GC_ROOTS    16      /* ranges added with mm_gc_add_root */
+#define VERIFY_PERIOD 64    /* default calls per incremental verifier check */
+#define GROW_MAXSLACK (1<<20) /* most a growth over-reserves (bytes) */
+
+/* Page map mode */
+#define PM_SHIFT     12                 /* log2 of page size */
+#define PM_PAGE      (1 << PM_SHIFT)
+#define PM_SPAN      (2 * PM_PAGE)      /* bytes of objects per span */
+#define PM_STEP      16                 /* size class granularity (bytes) */
+#define PM_MAXSMALL  512                /* largest size served from spans */
+#define PM_CLASSES   (PM_MAXSMALL / PM_STEP)
+#define PM_MAXOBJS   (PM_SPAN / PM_STEP)
+#define PM_BITS      10                 /* radix tree bits per level */
+#define PM_FANOUT    (1 << PM_BITS)     /* two levels cover a 4GB heap */
+
+#define PM_CLASS(size)    (((size) + PM_STEP-1) / PM_STEP - 1)
+#define PM_CLASS_SIZE(c)  (((c) + 1) * PM_STEP)
 
 #define MAX(x, y) ((x) > (y)? (x) : (y))  
+#define MIN(x, y) ((x) < (y)? (x) : (y))
+
+/* Round x up to a multiple of a, a power of 2 */
+#define ALIGN_UP(x, a) (((x) + ((a)-1)) & ~(uintptr_t)((a)-1))
+
+/* Block size giving size bytes whole cache lines: payload lines, then
+   our footer and the next header */
+#define LINED_SIZE(size) (ALIGN_UP(size, CACHELINE) + DSIZE)
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc)  ((size) | (alloc))
@@ -83,6 +327,16 @@ team_t team = {
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p)  (GET(p) & ~0x7)
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_ZERO(p)  (GET(p) & ZERO)
+
+/* Free block whose payload is known to be all zero, but for its links */
+#define ZERO         0x2
+
+/* Allocated block reached by the collector (during mm_gc only) */
+#define MARK         0x2
+
+/* Allocated block realloc has grown (MM_REALLOC_GROW) */
+#define GROWN        0x4
 
 /* Given block ptr bp, compute address of its header and footer */
 #define HDRP(bp)       ((char *)(bp) - WSIZE)  
@@ -93,19 +347,212 @@ team_t team = {
 #define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
 /* $end mallocmacros */
 
+/* Free list links: heap offsets, or pointers with MM_WIDE_LINKS */
+#ifdef MM_WIDE_LINKS
+typedef char *link_t;
+#define TO_LINK(bp)    ((char *)(bp))
+#define FROM_LINK(l)   (l)
+#else
+typedef uint32_t link_t;
+#define TO_LINK(bp)    ((bp) ? (uint32_t)((char *)(bp) - heap_base) : 0)
+#define FROM_LINK(l)   ((l) ? heap_base + (l) : NULL)
+#endif
+
+/* Given free block ptr bp, the links to the next and previous free blocks */
+#define NEXT_FREE(bp)  (((link_t *)(bp))[0])
+#define PREV_FREE(bp)  (((link_t *)(bp))[1])
+
+/* Smallest block: header, both links and footer */
+#define MIN_BLOCK      ALIGN_UP(2*sizeof(link_t) + OVERHEAD, DSIZE)
+
+#define SEG_LISTS      20   /* 16, 17-32, 33-64, ... bytes */
+#define SMALL_MAX      1024 /* sizes classed by table lookup (bytes) */
+
+/* Largest request served. Block sizes are 32 bits; the slack leaves room
+   for the tags and for rounding to an alignment or huge pages */
+#define MAX_REQUEST    ((size_t)UINT32_MAX - 2*HUGEPAGE)
+
+/* Lifetime regions */
+#define LIFE_CLASSES   3        /* MM_LIFE_DEFAULT, _SHORT, _LONG */
+#define MAX_REGIONS    1024     /* region table entries */
+#define LIFE_SITES     256      /* call sites tracked by MM_LIFETIME */
+#define LIFE_SAMPLES   256      /* sampled objects in flight */
+#define LIFE_RATE      64       /* sample one in LIFE_RATE calls per site */
+#define LIFE_SHORT     4096     /* mallocs a short-lived object lives under */
+#define LIFE_MIN       4        /* samples before a site is classified */
+#define LIFE_DECAY     64       /* samples kept before halving history */
+
+/* Hash of a pointer into a table of n (a power of 2) slots */
+#define PTR_HASH(p, n) ((((uintptr_t)(p) >> 3) * 0x9E3779B1u) & ((n)-1))
+
+/* A lifetime region: from start up to the next region's start */
+struct region {
+    char *start;
+    int life;                   /* MM_LIFE_* */
+};
+
+/* A call site seen by MM_LIFETIME */
+struct life_site {
+    void *site;                 /* return address into the caller */
+    unsigned calls;
+    unsigned samples;           /* sampled objects freed or evicted */
+    unsigned shorts;            /* ... of which were short-lived */
+    int life;                   /* class predicted for its next calls */
+};
+
+/* Sampled object awaiting its free */
+struct life_sample {
+    void *bp;
+    struct life_site *site;
+    unsigned long born;         /* malloc_count when allocated */
+};
+
+/* A range of memory scanned for roots */
+struct gc_range {
+    char *lo, *hi;
+};
+
+/* A callback registered with mm_on_pressure */
+struct pressure_cb {
+    void (*fn)(void *);
+    void *arg;
+};
+
+/* Span descriptor for page map mode */
+struct span {
+    char *start;                /* first object, page aligned */
+    uint32_t size;              /* object size (bytes) */
+    uint32_t nobjs;             /* objects in the span */
+    uint32_t nfree;             /* objects free */
+    int cls;                    /* size class */
+    struct span *next, *prev;   /* class list of spans with free objects */
+    uint64_t freemap[PM_MAXOBJS/64];  /* bit set iff slot is free */
+};
+
 /* Global variables */
 static char *heap_listp;  /* pointer to first block */  
+static char *heap_base;   /* what free list offsets are relative to */
+static link_t seg_lists[LIFE_CLASSES][SEG_LISTS]; /* first block of each free list */
 static char *next_fit_ptr; /* pointer to block after previously allocated block */
+static int heap_flags;     /* MM_* flags applied to every mm_malloc */
+static int fit_policy = MM_NEXT_FIT; /* find_fit placement */
+static int fit_k = GOOD_K; /* candidates considered by MM_GOOD_FIT */
+static uint32_t chunksize; /* current heap growth unit */
+static unsigned long malloc_count; /* mm_malloc calls, to gauge growth rate */
+static unsigned long last_grow;    /* malloc_count at the last growth */
+static struct mm_stats stats;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; /* see mm_lock */
+static __thread int lock_held; /* this thread holds heap_lock */
+static __thread int relief_owed; /* relieve was put off; see mm_unlock */
+static int self_alloc;     /* mm.c is allocating for itself */
+static char *zero_base;    /* heap start zero_hwm refers to */
+static char *zero_hwm;     /* everything from here up is untouched */
+static uint32_t zero_placed; /* block used by the last place was known zero */
+
+/* page map mode */
+static char *pm_base;                     /* heap start rounded down to a page */
+static struct span **pagemap[PM_FANOUT];  /* radix tree root; leaves in heap */
+static struct span *pm_partial[PM_CLASSES]; /* spans with free objects */
+static uint32_t pm_spans;                 /* live spans */
+
+/* lifetime regions */
+static struct region regions[MAX_REGIONS]; /* sorted by start */
+static int nregions;
+static int cur_life;                      /* class of the current mm_malloc */
+static struct life_site life_sites[LIFE_SITES];
+static struct life_sample life_samples[LIFE_SAMPLES];
+static int life_nsampled;                 /* live entries in life_samples */
+
+/* size classes, indexed by size in doublewords (see class_init) */
+static uint16_t small_asize[SMALL_MAX/DSIZE + 1]; /* request -> block size */
+static uint8_t small_seg[SMALL_MAX/DSIZE + 1];    /* block size -> free list */
+
+/* heap limits */
+static size_t soft_limit, hard_limit;     /* heap bytes, 0 for none */
+static size_t pressure_next;              /* heap size that reruns relief */
+static int in_pressure;                   /* relieve is running */
+static struct pressure_cb pressure_cbs[MAX_PRESSURE];
+static int npressure;
+
+/* garbage collection */
+static size_t gc_next = GC_MIN;           /* gc_placed that triggers MM_GC */
+static size_t gc_placed;                  /* bytes placed since collecting */
+static struct gc_range gc_roots[GC_ROOTS]; /* from mm_gc_add_root */
+static int gc_nroots;
+static char **gc_index;                   /* allocated blocks, by address */
+static long gc_nblocks;
+static char **gc_stack;                   /* marked blocks to scan */
+static long gc_depth;
+static char *gc_stack_top;                /* of the collecting thread */
+static size_t gc_kept;                    /* bytes the last sweep kept */
+
+/* incremental verification */
+static int verify_budget;     /* blocks checked per call, 0 for none */
+static int verify_period;     /* check on every verify_period'th call */
+static int verify_tick;       /* calls since the last check */
+static char *verify_cursor;   /* next block to check */
+static long verify_errors;    /* problems found since mm_init */
 
 /* unused optimization vars */
 //static int freed_blks;
 //static char *global_bfree;
 
+/* latency histograms */
+static struct mm_latency latency[SEG_LISTS];
+static unsigned long fit_visits;    /* blocks find_fit has looked at */
+
 /* function prototypes for internal helper routines */
 static void *extend_heap(size_t words);
+static void *grow_heap(size_t asize);
+static int relieve(size_t asize);
+static int pressure_run(void);
+static int collect(size_t asize);
+static uint64_t ticks(void);
+static void lat_record(uint32_t asize, uint64_t cycles, unsigned long visits);
+static int lat_bin(const unsigned long *bins, unsigned long calls,
+		   double pct);
+static int realloc_in_place(char *bp, uint32_t asize, int keep_slack);
+static uint32_t hugepage_round(uint32_t size);
+static void prefault(char *lo, size_t len);
 static void place(void *bp, size_t asize);
+static int policy_for(size_t asize);
 static void *find_fit(size_t asize);
+static void *find_next_fit(size_t asize);
+static void *find_first_fit(size_t asize);
+static void *find_seg_fit(size_t asize, int k);
+static void class_init(void);
+static uint32_t adjust_size(size_t size);
+static int seg_index(uint32_t size);
+static void seg_insert(void *bp);
+static void seg_remove(void *bp);
+static link_t seg_sort(link_t head);
+static void *malloc_cacheline(size_t size);
+static int lined(char *bp);
+static void *malloc_aligned(size_t asize, size_t align);
+static char *aligned_in(void *bp, size_t asize, size_t align);
+static void *find_aligned_fit(size_t asize, size_t align);
+static void *place_aligned(void *bp, size_t asize, size_t align);
 static void *coalesce(void *bp);
+static int region_of(void *bp);
+static int needs_fence(void);
+static void *malloc_auto(size_t size, void *site);
+static void life_learn(struct life_site *s, int is_short);
+static void life_freed(void *bp);
+static int verify_due(void);
+static void verify_step(int n);
+static void verify_block(char *bp);
+static void verify_list(int life, int i, int n);
+static void *pm_malloc(size_t size);
+static void pm_free(struct span *s, void *bp);
+static struct span *pm_lookup(void *bp);
+static int pm_set(char *page, struct span *s);
+static struct span *span_new(int cls);
+static void span_release(struct span *s);
+static void gc_roots_scan(void);
+static void gc_stack_scan(void) __attribute__((noinline));
+static void gc_scan(char *lo, char *hi);
+static void gc_mark(char *p);
+static size_t gc_sweep(void);
 static void printblock(void *bp); 
 static void checkblock(void *bp);
 
@@ -118,6 +565,15 @@ int mm_init(void)
     /* create the initial empty heap */
     if ((heap_listp = mem_sbrk(4*WSIZE)) == NULL)
 	return -1;
+    heap_base = heap_listp;
+    if (small_asize[0] == 0)
+	class_init();
+    memset(seg_lists, 0, sizeof(seg_lists));
+    regions[0].start = heap_listp;
+    regions[0].life = MM_LIFE_DEFAULT;
+    nregions = 1;
+    memset(life_samples, 0, sizeof(life_samples));
+    life_nsampled = 0;
     PUT(heap_listp, 0);                        /* alignment padding */
     PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));  /* prologue header */
 	heap_listp += DSIZE;
@@ -125,14 +581,35 @@ int mm_init(void)
     PUT(heap_listp, PACK(OVERHEAD, 1));  /* prologue footer */ 
     PUT(heap_listp+WSIZE, PACK(0, 1));   /* epilogue header */ 
 
+    /* a new heap is fresh memory; a reset one is dirty up to zero_hwm */
+    if (zero_base != mem_heap_lo()) {
+	zero_base = mem_heap_lo();
+	zero_hwm = (char *)mem_heap_hi() + 1;
+    }
+
 	next_fit_ptr = heap_listp; /* initialize nfp to beginning of heap */
+    verify_cursor = heap_listp;
+    verify_errors = 0;
+    pressure_next = soft_limit;
+    gc_next = GC_MIN;
+    gc_placed = 0;
+
+    pm_base = (char *)((uintptr_t)mem_heap_lo() & ~(uintptr_t)(PM_PAGE-1));
+    memset(pagemap, 0, sizeof(pagemap));
+    memset(pm_partial, 0, sizeof(pm_partial));
+    pm_spans = 0;
 
 // unused opt initializations
 //  global_bfree = NULL;
 //  freed_blks = 0;
 
+    memset(&stats, 0, sizeof(stats));
+    memset(latency, 0, sizeof(latency));
+    chunksize = CHUNKSIZE;
+    malloc_count = last_grow = 0;
+
     /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-    if (extend_heap(CHUNKSIZE/WSIZE) == NULL)
+    if (extend_heap(hugepage_round(CHUNKSIZE)/WSIZE) == NULL)
 	return -1;
     return 0;
 }
@@ -145,48 +622,434 @@ int mm_init(void)
 void *mm_malloc(size_t size) 
 {
     uint32_t asize;      /* adjusted block size */
-    uint32_t extendsize; /* amount to extend heap if no fit */
     char *bp;      
+    uint64_t t = 0;
+    int check;
 
-    /* Ignore spurious requests */
-    if (size <= 0)
+    /* Ignore spurious requests, and those no block size can hold */
+    if (size <= 0 || size > MAX_REQUEST)
 	return NULL;
 
+    if ((heap_flags & MM_LIFETIME) && cur_life == MM_LIFE_DEFAULT)
+	return malloc_auto(size, __builtin_return_address(0));
+    if ((check = verify_due()))
+	verify_step(verify_budget);
+
+    if (heap_flags & MM_CACHELINE)
+	return malloc_cacheline(size);
+    malloc_count++;
+
+    if ((heap_flags & MM_PAGEMAP) && size <= PM_MAXSMALL)
+	return pm_malloc(size);
+
+    if (heap_flags & MM_LATENCY) {
+	fit_visits = 0;
+	t = ticks();
+    }
+
     /* Adjust block size to include overhead and alignment reqs. */
-    if (size <= DSIZE)
-	asize = DSIZE + OVERHEAD;
-    else
-	asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+    asize = adjust_size(size);
+    if (check)
+	verify_list(cur_life, seg_index(asize), verify_budget);
     
-    /* Search the free list for a fit */
-    if ((bp = find_fit(asize)) != NULL) {
+    /* Search the free list for a fit; before growing, collect garbage
+       and shed memory near the limit */
+    if ((bp = find_fit(asize)) == NULL && collect(asize))
+	bp = find_fit(asize);
+    if (bp == NULL && relieve(asize))
+	bp = find_fit(asize);
+    if (bp != NULL) {
 	place(bp, asize);
     /* start next find_fit search at next block, this one is already allocated */
-    next_fit_ptr = NEXT_BLKP(bp); 
-	return bp;
+	if (policy_for(asize) == MM_NEXT_FIT)
+	    next_fit_ptr = NEXT_BLKP(bp); 
     }
 
     /* No fit found. Get more memory and place the block */
-    extendsize = MAX(asize,CHUNKSIZE);
-    if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
-	return NULL;
-    place(bp, asize);
-    next_fit_ptr = NEXT_BLKP(bp);
+    else if ((bp = grow_heap(asize)) != NULL) {
+	place(bp, asize);
+	next_fit_ptr = NEXT_BLKP(bp);
+    }
+    if (heap_flags & MM_LATENCY)
+	lat_record(asize, ticks() - t, fit_visits);
     return bp;
 } 
 /* $end mmmalloc */
 
+/*
+ * mm_malloc_hint - mm_malloc into the regions of a lifetime class
+ */
+void *mm_malloc_hint(size_t size, int life)
+{
+    void *bp;
+
+    if (life < 0 || life >= LIFE_CLASSES)
+	life = MM_LIFE_DEFAULT;
+    cur_life = life;
+    bp = mm_malloc(size);
+    cur_life = MM_LIFE_DEFAULT;
+    return bp;
+}
+
+/*
+ * mm_trim - Return the whole pages inside free blocks to the kernel
+ *           (whole huge pages in huge page mode); returns bytes released
+ */
+size_t mm_trim(void)
+{
+    size_t unit = (heap_flags & MM_HUGEPAGE) ? HUGEPAGE : mem_pagesize();
+    size_t released = 0;
+    char *bp, *lo, *hi;
+
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+	if (GET_ALLOC(HDRP(bp)))
+	    continue;
+	/* keep the links; the footer ends the range */
+	lo = (char *)ALIGN_UP((uintptr_t)bp + 2*sizeof(link_t), unit);
+	hi = (char *)((uintptr_t)FTRP(bp) & ~(uintptr_t)(unit-1));
+	if (lo >= hi || madvise(lo, hi - lo, MADV_DONTNEED) != 0)
+	    continue;
+	released += hi - lo;
+	/* the released pages read back as zero; clear the rest to match */
+	if (!GET_ZERO(HDRP(bp)) && unit < HUGEPAGE) {
+	    memset(bp + 2*sizeof(link_t), 0, lo - (bp + 2*sizeof(link_t)));
+	    memset(hi, 0, FTRP(bp) - hi);
+	    PUT(HDRP(bp), GET(HDRP(bp)) | ZERO);
+	    PUT(FTRP(bp), GET(FTRP(bp)) | ZERO);
+	}
+    }
+    stats.trim_bytes += released;
+    return released;
+}
+
+/*
+ * mm_sort_free_lists - Put every free list in address order
+ */
+void mm_sort_free_lists(void)
+{
+    char *bp, *prev;
+    int c, i;
+
+    for (c = 0; c < LIFE_CLASSES; c++) {
+	for (i = 0; i < SEG_LISTS; i++) {
+	    seg_lists[c][i] = seg_sort(seg_lists[c][i]);
+	    /* the sort follows next links only; redo the prev links */
+	    prev = NULL;
+	    for (bp = FROM_LINK(seg_lists[c][i]); bp;
+		 bp = FROM_LINK(NEXT_FREE(bp))) {
+		PREV_FREE(bp) = TO_LINK(prev);
+		prev = bp;
+	    }
+	}
+    }
+}
+
+/*
+ * mm_set_limits - Cap the heap at soft and hard bytes (0: no limit)
+ */
+void mm_set_limits(size_t soft, size_t hard)
+{
+    soft_limit = soft;
+    hard_limit = hard;
+    pressure_next = soft;
+}
+
+/*
+ * mm_on_pressure - Have relieve call fn(arg) near the soft limit; returns
+ *                  -1 if the table is full
+ */
+int mm_on_pressure(void (*fn)(void *), void *arg)
+{
+    if (npressure == MAX_PRESSURE)
+	return -1;
+    pressure_cbs[npressure].fn = fn;
+    pressure_cbs[npressure].arg = arg;
+    npressure++;
+    return 0;
+}
+
+/*
+ * mm_gc - Free every allocated block no root reaches; returns bytes freed
+ */
+size_t mm_gc(void)
+{
+    struct timespec t0, t1;
+    size_t freed;
+    long n = 0, ns;
+    char *bp;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    /* index the allocated blocks; prologue and fences have no payload */
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+	if (GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) > OVERHEAD)
+	    n++;
+    if (n == 0)
+	return 0;
+    gc_index = mmap(NULL, 2 * n * sizeof(char *), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (gc_index == MAP_FAILED)
+	return 0;
+    gc_stack = gc_index + n;
+    gc_nblocks = 0;
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+	if (GET_ALLOC(HDRP(bp)) && GET_SIZE(HDRP(bp)) > OVERHEAD)
+	    gc_index[gc_nblocks++] = bp;
+
+    gc_depth = 0;
+    gc_roots_scan();
+    while (gc_depth > 0) {
+	bp = gc_stack[--gc_depth];
+	gc_scan(bp, FTRP(bp));
+    }
+    freed = gc_sweep();
+    munmap(gc_index, 2 * n * sizeof(char *));
+    gc_index = gc_stack = NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ns = (t1.tv_sec - t0.tv_sec) * 1000000000L + (t1.tv_nsec - t0.tv_nsec);
+    gc_placed = 0;
+    stats.gc_runs++;
+    stats.gc_bytes += freed;
+    stats.gc_ns += ns;
+    if (ns > stats.gc_max_ns)
+	stats.gc_max_ns = ns;
+    return freed;
+}
+
+/*
+ * mm_gc_add_root - Have mm_gc scan [p, p+len) for pointers; returns -1
+ *                  if the table is full
+ */
+int mm_gc_add_root(void *p, size_t len)
+{
+    if (gc_nroots == GC_ROOTS)
+	return -1;
+    gc_roots[gc_nroots].lo = p;
+    gc_roots[gc_nroots].hi = (char *)p + len;
+    gc_nroots++;
+    return 0;
+}
+
+/*
+ * mm_gc_remove_root - Stop scanning the range added at p
+ */
+void mm_gc_remove_root(void *p)
+{
+    int i;
+
+    for (i = 0; i < gc_nroots; i++) {
+	if (gc_roots[i].lo == p) {
+	    gc_roots[i] = gc_roots[--gc_nroots];
+	    return;
+	}
+    }
+}
+
+/*
+ * mm_set_verify - Check budget blocks on every period'th mm_malloc/mm_free
+ *                 call (budget 0: off, period 0: VERIFY_PERIOD)
+ */
+void mm_set_verify(int budget, int period)
+{
+    verify_budget = budget > 0 ? budget : 0;
+    verify_period = period > 0 ? period : VERIFY_PERIOD;
+    verify_tick = 0;
+}
+
+/*
+ * mm_verify_errors - Problems the incremental verifier found since mm_init
+ */
+long mm_verify_errors(void)
+{
+    return verify_errors;
+}
+
+/*
+ * mm_malloc_flags - mm_malloc with per-call MM_* flags
+ */
+void *mm_malloc_flags(size_t size, int flags)
+{
+    if ((flags & MM_CACHELINE) && size > 0 && size <= MAX_REQUEST)
+	return malloc_cacheline(size);
+    return mm_malloc(size);
+}
+
+/*
+ * mm_memalign - Allocate size bytes at an align-aligned payload; align is
+ *               a power of 2
+ */
+void *mm_memalign(size_t align, size_t size)
+{
+    if (align <= DSIZE || size == 0)
+	return mm_malloc(size);
+    if (size > MAX_REQUEST || align > MAX_REQUEST - size)
+	return NULL;
+    malloc_count++;
+    return malloc_aligned(adjust_size(size), align);
+}
+
+/*
+ * mm_usable_size - Payload bytes ptr's block has, at least those asked for
+ */
+size_t mm_usable_size(void *ptr)
+{
+    struct span *s;
+
+    if (ptr == NULL)
+	return 0;
+    if (pm_spans && (s = pm_lookup(ptr)) != NULL)
+	return s->size;
+    return GET_SIZE(HDRP(ptr)) - OVERHEAD;
+}
+
+/*
+ * mm_try_expand - Make ptr's block hold size bytes without moving it;
+ *                 returns 1 if it does, 0 if it is left as it was
+ */
+int mm_try_expand(void *ptr, size_t size)
+{
+    uint32_t asize;
+
+    if (ptr == NULL)
+	return 0;
+    /* spans have one object size */
+    if (pm_spans && pm_lookup(ptr))
+	return size <= mm_usable_size(ptr);
+    if (size > MAX_REQUEST)
+	return 0;
+    /* cache line blocks grow by whole lines, keeping them to themselves */
+    asize = lined(ptr) ? LINED_SIZE(size) : adjust_size(size);
+    return realloc_in_place(ptr, asize, 1);
+}
+
+/*
+ * mm_set_flags - Set the MM_* flags applied to every mm_malloc
+ */
+void mm_set_flags(int flags)
+{
+    heap_flags = flags;
+}
+
+/*
+ * mm_set_policy - Choose the placement policy; k bounds MM_GOOD_FIT's
+ *                 search (0 for the default)
+ */
+void mm_set_policy(int policy, int k)
+{
+    fit_policy = policy;
+    fit_k = k > 0 ? k : GOOD_K;
+}
+
+/*
+ * mm_lock - mm.c is not thread safe; layers that call it from several
+ *           threads serialize their calls on this one lock. mm_unlock
+ *           returns 1 if it ran relief a malloc under the lock put off,
+ *           so that a malloc that failed at the hard limit is worth
+ *           retrying.
+ */
+void mm_lock(void)
+{
+    pthread_mutex_lock(&heap_lock);
+    lock_held = 1;
+}
+
+int mm_unlock(void)
+{
+    lock_held = 0;
+    pthread_mutex_unlock(&heap_lock);
+    return relief_owed ? pressure_run() : 0;
+}
+
+/*
+ * mm_get_stats - Copy out heap growth counters since mm_init
+ */
+void mm_get_stats(struct mm_stats *st)
+{
+    *st = stats;
+    st->chunksize = chunksize;
+}
+
+/*
+ * mm_get_latency - Copy out the histograms of the first n size classes;
+ *                  returns how many classes there are
+ */
+int mm_get_latency(struct mm_latency *lat, int n)
+{
+    if (n > 0)
+	memcpy(lat, latency, MIN(n, SEG_LISTS) * sizeof(struct mm_latency));
+    return SEG_LISTS;
+}
+
+/*
+ * mm_dump_latency - Print each size class's latency and visit
+ *                   percentiles, then the bins that are not empty.
+ *                   Percentiles are the upper bounds of their bins.
+ */
+void mm_dump_latency(FILE *f)
+{
+    struct mm_latency *l;
+    int i, b;
+
+    fprintf(f, "%-13s %9s %8s %8s %8s %10s %6s %6s %8s\n", "block size",
+	    "calls", "p50 cyc", "p99 cyc", "p99.9", "max cyc", "p50 v",
+	    "p99 v", "max v");
+    for (i = 0; i < SEG_LISTS; i++) {
+	l = &latency[i];
+	if (l->calls == 0)
+	    continue;
+	fprintf(f, "%6u-%-6u %9lu %8lu %8lu %8lu %10llu %6lu %6lu %8lu\n",
+		l->min_size, l->max_size, l->calls,
+		2UL << lat_bin(l->cycles, l->calls, 50),
+		2UL << lat_bin(l->cycles, l->calls, 99),
+		2UL << lat_bin(l->cycles, l->calls, 99.9), l->max_cycles,
+		(2UL << lat_bin(l->visits, l->calls, 50)) - 2,
+		(2UL << lat_bin(l->visits, l->calls, 99)) - 2, l->max_visits);
+    }
+    for (i = 0; i < SEG_LISTS; i++) {
+	l = &latency[i];
+	if (l->calls == 0)
+	    continue;
+	fprintf(f, "%6u-%-6u cycles", l->min_size, l->max_size);
+	for (b = 0; b < MM_LAT_BINS; b++)
+	    if (l->cycles[b])
+		fprintf(f, " <%lu:%lu", 2UL << b, l->cycles[b]);
+	fprintf(f, "\n%13s visits", "");
+	for (b = 0; b < MM_LAT_BINS; b++)
+	    if (l->visits[b])
+		fprintf(f, " <=%lu:%lu", (2UL << b) - 2, l->visits[b]);
+	fprintf(f, "\n");
+    }
+}
+
 /* 
  * mm_free - Free a block 
  */
 /* $begin mmfree */
 void mm_free(void *bp)
 {
-    uint32_t size = GET_SIZE(HDRP(bp));
+    uint32_t size;
+    struct span *s;
+    int check;
+
+    if (life_nsampled)
+	life_freed(bp);
+    if ((check = verify_due()))
+	verify_step(verify_budget);
+
+    /* span objects have no header; the page map knows their size */
+    if (pm_spans && (s = pm_lookup(bp)) != NULL) {
+	pm_free(s, bp);
+	return;
+    }
+
+    size = GET_SIZE(HDRP(bp));
 
     PUT(HDRP(bp), PACK(size, 0));
     PUT(FTRP(bp), PACK(size, 0));
-    coalesce(bp);
+    bp = coalesce(bp);
+    if (check)
+	verify_list(region_of(bp), seg_index(GET_SIZE(HDRP(bp))), verify_budget);
 
 /* unused utilization optimizations, worse throughput */
 /*    freed_blks++;
@@ -205,31 +1068,98 @@ void mm_free(void *bp)
 /* $end mmfree */
 
 /*
- * mm_realloc - naive implementation of mm_realloc
+ * mm_realloc - Resize ptr to size bytes, in place if there is room; as
+ *              mm_malloc for a NULL ptr, as mm_free for size 0. Returns
+ *              NULL and leaves ptr alone if there is no room at all.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
     void *newp;
-    size_t copySize;
-
-    if ((newp = mm_malloc(size)) == NULL) {
-	printf("ERROR: mm_malloc failed in mm_realloc\n");
-	exit(1);
+    size_t copySize, req = size;
+    uint32_t asize, oldsize, want, grown = 0;
+    int span, isolated;
+
+    if (ptr == NULL)
+	return mm_malloc(size);
+    if (size == 0) {
+	mm_free(ptr);
+	return NULL;
+    }
+    if (size > MAX_REQUEST)
+	return NULL;            /* ptr is left as it was */
+    stats.realloc_calls++;
+    /* span objects have their own size rules; cache line blocks are
+       resized and moved by whole lines */
+    span = pm_spans && pm_lookup(ptr);
+    isolated = !span && lined(ptr);
+    if (!span) {
+	asize = isolated ? LINED_SIZE(size) : adjust_size(size);
+	oldsize = GET_SIZE(HDRP(ptr));
+	want = asize;
+	if ((heap_flags & MM_REALLOC_GROW) && !isolated) {
+	    grown = GET(HDRP(ptr)) & GROWN;
+	    if (asize > oldsize && grown)
+		want = MAX(asize, MIN(2 * oldsize, asize + GROW_MAXSLACK));
+	    grown |= asize > oldsize ? GROWN : 0;
+	}
+	if (realloc_in_place(ptr, want, grown)
+	    || (want > asize && realloc_in_place(ptr, asize, 1))) {
+	    PUT(HDRP(ptr), GET(HDRP(ptr)) | grown);
+	    PUT(FTRP(ptr), GET(FTRP(ptr)) | grown);
+	    return ptr;
+	}
+	size = MAX(size, want - OVERHEAD);   /* over-reserve when moving */
     }
-    copySize = GET_SIZE(HDRP(ptr));
+
+    /* without room for the slack, move to just what was asked for */
+    if (isolated)
+	newp = malloc_cacheline(size = req);
+    else if ((newp = mm_malloc(size)) == NULL && size != req)
+	newp = mm_malloc(size = req);
+    if (newp == NULL)
+	return NULL;            /* ptr is left as it was */
+    copySize = mm_usable_size(ptr);
     if (size < copySize)
       copySize = size;
     memcpy(newp, ptr, copySize);
     mm_free(ptr);
+    stats.realloc_moves++;
+    stats.realloc_copied += copySize;
+    if (grown && !(pm_spans && pm_lookup(newp))) {
+	PUT(HDRP(newp), GET(HDRP(newp)) | grown);
+	PUT(FTRP(newp), GET(FTRP(newp)) | grown);
+    }
     return newp;
 }
 
+/*
+ * mm_calloc - Allocate nmemb zeroed elements of size bytes, clearing only
+ *             blocks not already known to be zero
+ */
+void *mm_calloc(size_t nmemb, size_t size)
+{
+    void *bp;
+
+    if (nmemb && size > SIZE_MAX / nmemb)
+	return NULL;
+    size *= nmemb;
+
+    zero_placed = 0;
+    if ((bp = mm_malloc(size)) != NULL)
+	/* a known-zero block still has its free list links */
+	memset(bp, 0, zero_placed && size > 2*sizeof(link_t) ?
+	       2*sizeof(link_t) : size);
+    return bp;
+}
+
 /* 
  * mm_checkheap - Check the heap for consistency 
  */
 void mm_checkheap(int verbose) 
 {
-    char *bp = heap_listp;
+    char *bp = heap_listp, *prev;
+    long nfree = 0;
+    int i, c;
 
     if (verbose)
 	printf("Heap (%p):\n", heap_listp);
@@ -242,6 +1172,8 @@ void mm_checkheap(int verbose)
 	if (verbose) 
 	    printblock(bp);
 	checkblock(bp);
+	if (!GET_ALLOC(HDRP(bp)))
+	    nfree++;
     // if (global_bfree && GET_ALLOC(HDRP(global_bfree)))
     // printf("global_bfree allocated. Error.\n");
     }
@@ -250,6 +1182,30 @@ void mm_checkheap(int verbose)
 	printblock(bp);
     if ((GET_SIZE(HDRP(bp)) != 0) || !(GET_ALLOC(HDRP(bp))))
 	printf("Bad epilogue header\n");
+
+    /* every free block is on the list for its size, and nothing else is */
+    for (c = 0; c < LIFE_CLASSES; c++) {
+	for (i = 0; i < SEG_LISTS; i++) {
+	    prev = NULL;
+	    for (bp = FROM_LINK(seg_lists[c][i]); bp;
+		 bp = FROM_LINK(NEXT_FREE(bp))) {
+		if (GET_ALLOC(HDRP(bp)))
+		    printf("Error: allocated block %p on free list %d\n", bp, i);
+		if (seg_index(GET_SIZE(HDRP(bp))) != i)
+		    printf("Error: %p on free list %d, not %d\n", bp, i,
+			   seg_index(GET_SIZE(HDRP(bp))));
+		if (region_of(bp) != c)
+		    printf("Error: %p on lifetime %d lists, not %d\n", bp, c,
+			   region_of(bp));
+		if (FROM_LINK(PREV_FREE(bp)) != prev)
+		    printf("Error: %p has a bad prev link\n", bp);
+		prev = bp;
+		nfree--;
+	    }
+	}
+    }
+    if (nfree)
+	printf("Error: %ld free blocks not on the free lists\n", nfree);
 }
 
 /* 
@@ -259,16 +1215,46 @@ void mm_checkheap(int verbose)
 static void *extend_heap(size_t words) 
 {
     char *bp;
-    uint32_t size;
+    uint32_t size, zero;
+    int fence = needs_fence();
 	
     /* Allocate an even number of words to maintain alignment */
     size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
+    if (hard_limit && mem_heapsize() + size > hard_limit) {
+	stats.limit_fails++;
+	return NULL;
+    }
     if ((bp = mem_sbrk(size)) == (void *)-1) 
 	return NULL;
+    zero = bp >= zero_hwm ? ZERO : 0;
+    if (bp + size > zero_hwm)
+	zero_hwm = bp + size;
+    stats.sbrk_calls++;
+    stats.sbrk_bytes += size;
+    if (heap_flags & MM_PREFAULT)
+	prefault(bp, size);
+    if (heap_flags & MM_HUGEPAGE) {
+	/* whole huge pages in the new chunk; the heap end is aligned */
+	char *lo = (char *)ALIGN_UP((uintptr_t)bp, HUGEPAGE);
+	char *hi = (char *)(((uintptr_t)bp + size) & ~(uintptr_t)(HUGEPAGE-1));
+
+	if (lo < hi)
+	    madvise(lo, hi - lo, MADV_HUGEPAGE);
+    }
+
+    /* a new region starts behind a fence where the epilogue was */
+    if (fence) {
+	PUT(HDRP(bp), PACK(OVERHEAD, 1));
+	PUT(bp, PACK(OVERHEAD, 1));
+	bp += DSIZE;
+	size -= DSIZE;
+	regions[nregions].start = bp;
+	regions[nregions++].life = cur_life;
+    }
 
     /* Initialize free block header/footer and the epilogue header */
-    PUT(HDRP(bp), PACK(size, 0));         /* free block header */
-    PUT(FTRP(bp), PACK(size, 0));         /* free block footer */
+    PUT(HDRP(bp), PACK(size, zero));      /* free block header */
+    PUT(FTRP(bp), PACK(size, zero));      /* free block footer */
     PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); /* new epilogue header */
 
     /* Coalesce if the previous block was free */
@@ -276,54 +1262,341 @@ static void *extend_heap(size_t words)
 }
 /* $end mmextendheap */
 
-/* 
- * place - Place block of asize bytes at start of free block bp 
- *         and split if remainder would be at least minimum block size
+/*
+ * grow_heap - Extend the heap to fit asize, adapting the growth unit to
+ *             how often the heap has had to grow lately
  */
-/* $begin mmplace */
-/* $begin mmplace-proto */
-static void place(void *bp, size_t asize)
-/* $end mmplace-proto */
+static void *grow_heap(size_t asize)
 {
+    unsigned long since = malloc_count - last_grow;
+    size_t heap = mem_heapsize();
+    uint32_t extendsize;
+    void *bp;
+
+    if (needs_fence())
+	asize += DSIZE;
+
+    if (!(heap_flags & MM_FIXED_CHUNK)) {
+	if (since < GROW_FAST && chunksize < MAXCHUNK)
+	    chunksize *= 2;
+	else if (since > GROW_SLOW && chunksize > MINCHUNK)
+	    chunksize /= 2;
+    }
+    last_grow = malloc_count;
+
+    extendsize = MAX(asize, chunksize);
+    /* up to the soft limit, then only what this request needs */
+    if (soft_limit && heap + extendsize > soft_limit)
+	extendsize = MAX(asize, soft_limit > heap ? soft_limit - heap : 0);
+    extendsize = hugepage_round(extendsize);
+    if ((bp = extend_heap(extendsize/WSIZE)) == NULL && extendsize > asize)
+	bp = extend_heap(asize/WSIZE);  /* near the heap limit, take only asize */
+    return bp;
+}
 
-    uint32_t csize = GET_SIZE(HDRP(bp));   
+/*
+ * relieve - If growing the heap by asize would pass the soft limit (again),
+ *           run the pressure callbacks and trim; returns 1 if it did, so
+ *           the caller looks for a fit once more. Under mm_lock, or inside
+ *           an allocation mm.c makes for itself, it only owes the run.
+ */
+static int relieve(size_t asize)
+{
+    size_t heap = mem_heapsize();
+
+    /* always before failing at the hard limit */
+    if (soft_limit == 0 || in_pressure
+	|| (!relief_owed && heap + asize <= pressure_next
+	    && (hard_limit == 0 || heap + asize <= hard_limit)))
+	return 0;
+    if (lock_held || self_alloc) {
+	relief_owed = 1;
+	return 0;
+    }
+    pressure_run();
+    return 1;
+}
+
+/*
+ * pressure_run - Run the pressure callbacks, which free into mm.c through
+ *                layers that take mm_lock, then trim; returns 0 if another
+ *                thread was at it already. The caller does not hold
+ *                mm_lock and has no change to the heap under way.
+ */
+static int pressure_run(void)
+{
+    int life, i;
+    size_t step;
+
+    relief_owed = 0;
+    mm_lock();
+    if (in_pressure) {
+	mm_unlock();
+	return 0;
+    }
+    in_pressure = 1;
+    stats.pressure_runs++;
+    life = cur_life;
+    cur_life = MM_LIFE_DEFAULT;
+    mm_unlock();
+
+    for (i = 0; i < npressure; i++)
+	pressure_cbs[i].fn(pressure_cbs[i].arg);
+
+    mm_lock();
+    mm_trim();
+    step = MAX(soft_limit / PRESSURE_STEPS, chunksize);
+    pressure_next = MAX(soft_limit, mem_heapsize() + step);
+    cur_life = life;
+    in_pressure = 0;
+    mm_unlock();
+    return 1;
+}
+
+/*
+ * realloc_in_place - Make allocated block bp asize bytes without moving
+ *                    it, if its free successor or the top of the heap has
+ *                    the room; returns 1 if it did. Shrinking leaves the
+ *                    slack in the block if keep_slack is set.
+ */
+static int realloc_in_place(char *bp, uint32_t asize, int keep_slack)
+{
+    uint32_t size = GET_SIZE(HDRP(bp)), total;
+    char *next = NEXT_BLKP(bp), *rem;
 
-    if ((csize - asize) >= (DSIZE + OVERHEAD)) { 
+    if (asize <= size) {
+	if (keep_slack || size - asize < MIN_BLOCK)
+	    return 1;
 	PUT(HDRP(bp), PACK(asize, 1));
 	PUT(FTRP(bp), PACK(asize, 1));
-	bp = NEXT_BLKP(bp);
-	PUT(HDRP(bp), PACK(csize-asize, 0));
-	PUT(FTRP(bp), PACK(csize-asize, 0));
+	rem = NEXT_BLKP(bp);
+	PUT(HDRP(rem), PACK(size - asize, 0));
+	PUT(FTRP(rem), PACK(size - asize, 0));
+	coalesce(rem);
+	return 1;
     }
-    else { 
-    PUT(HDRP(bp), PACK(csize, 1));
-	PUT(FTRP(bp), PACK(csize, 1));
+
+    total = size + (GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next)));
+    if (total < asize) {
+	/* the last block can grow the heap under it, unless a fence is due */
+	char *end = GET_ALLOC(HDRP(next)) ? next : NEXT_BLKP(next);
+
+	if (GET_SIZE(HDRP(end)) != 0 || needs_fence()
+	    || extend_heap(hugepage_round(MAX(asize - total, MIN_BLOCK))/WSIZE)
+	       == NULL)
+	    return 0;
+	next = NEXT_BLKP(bp);   /* the new free block, merged with next */
+	total = size + GET_SIZE(HDRP(next));
     }
 
+    seg_remove(next);
+    if (total - asize >= MIN_BLOCK) {
+	PUT(HDRP(bp), PACK(asize, 1));
+	PUT(FTRP(bp), PACK(asize, 1));
+	rem = NEXT_BLKP(bp);
+	PUT(HDRP(rem), PACK(total - asize, 0));
+	PUT(FTRP(rem), PACK(total - asize, 0));
+	seg_insert(rem);
+    }
+    else {
+	PUT(HDRP(bp), PACK(total, 1));
+	PUT(FTRP(bp), PACK(total, 1));
+    }
+    /* next is inside bp or the remainder now */
+    if (next_fit_ptr > bp && next_fit_ptr < bp + total)
+	next_fit_ptr = NEXT_BLKP(bp);
+    if (verify_cursor > bp && verify_cursor < bp + total)
+	verify_cursor = bp;
+    return 1;
 }
-/* $end mmplace */
 
-/* 
- * find_fit - Find a fit for a block with asize bytes 
+/*
+ * ticks - The time stamp counter where there is one, else nanoseconds
  */
-static void *find_fit(size_t asize)
-{ 
-/*  NEXT FIT IMPLEMENTATION */
-   
-     char *bp = next_fit_ptr;
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
 
-// unused global_bfree optimization 
-/*    if ((global_bfree) && (!GET_ALLOC(HDRP(global_bfree))) && (asize <= GET_SIZE(HDRP(global_bfree)))) {
-         char *free = global_bfree;
-         global_bfree = NULL;
-         return free;
-    }
-*/  
-  
-    /* starting at next_fit_ptr, search for free block of at least asize */
-    for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
-    
-    if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp)))) {
+/*
+ * lat_record - Count a malloc of an asize block that took cycles and
+ *              looked at visits blocks
+ */
+static void lat_record(uint32_t asize, uint64_t cycles, unsigned long visits)
+{
+    struct mm_latency *l = &latency[seg_index(asize)];
+
+    if (l->calls++ == 0 || asize < l->min_size)
+	l->min_size = asize;
+    l->max_size = MAX(l->max_size, asize);
+    l->cycles[MIN(cycles ? 63 - __builtin_clzll(cycles) : 0, MM_LAT_BINS-1)]++;
+    l->visits[MIN(63 - __builtin_clzll(visits + 1), MM_LAT_BINS-1)]++;
+    l->max_cycles = MAX(l->max_cycles, cycles);
+    l->max_visits = MAX(l->max_visits, visits);
+}
+
+/*
+ * lat_bin - The histogram bin that holds the pct'th percentile of calls
+ */
+static int lat_bin(const unsigned long *bins, unsigned long calls, double pct)
+{
+    unsigned long seen = 0;
+    int b;
+
+    for (b = 0; b < MM_LAT_BINS - 1; b++)
+	if ((seen += bins[b]) >= calls * pct / 100)
+	    break;
+    return b;
+}
+
+/*
+ * collect - With MM_GC, collect before growing the heap by asize once
+ *           enough has been placed since the last collection; returns 1
+ *           if it collected, so the caller looks for a fit once more
+ */
+static int collect(size_t asize)
+{
+    if (!(heap_flags & MM_GC) || gc_placed + asize <= gc_next)
+	return 0;
+    mm_gc();
+    gc_next = MAX(GC_MIN, (GC_GROWTH - 1) * gc_kept);
+    /* the sweep's frees leave next fit's rover high; search it all */
+    next_fit_ptr = heap_listp;
+    return 1;
+}
+
+/*
+ * hugepage_round - In huge page mode, stretch a heap extension of size
+ *                  bytes so the heap ends on a huge page boundary
+ */
+static uint32_t hugepage_round(uint32_t size)
+{
+    uintptr_t brk;
+
+    if (!(heap_flags & MM_HUGEPAGE))
+	return size;
+    brk = (uintptr_t)mem_heap_hi() + 1;
+    return ALIGN_UP(brk + size, HUGEPAGE) - brk;
+}
+
+/*
+ * prefault - Fault in the pages of [lo, lo+len) now rather than on first
+ *            use; pages only partly in the range were touched by the tags
+ */
+static void prefault(char *lo, size_t len)
+{
+    uintptr_t pagesize = mem_pagesize();
+    char *p = (char *)ALIGN_UP((uintptr_t)lo, pagesize);
+    char *hi = (char *)((uintptr_t)(lo + len) & ~(pagesize-1));
+
+    if (p >= hi)
+	return;
+    stats.prefault_pages += (hi - p) / pagesize;
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(p, hi - p, MADV_POPULATE_WRITE) == 0)
+	return;
+#endif
+    /* older kernels: touch each page without changing it */
+    for (; p < hi; p += pagesize)
+	*(volatile char *)p = *(volatile char *)p;
+}
+
+/* 
+ * place - Place block of asize bytes at start of free block bp 
+ *         and split if remainder would be at least minimum block size
+ */
+/* $begin mmplace */
+/* $begin mmplace-proto */
+static void place(void *bp, size_t asize)
+/* $end mmplace-proto */
+{
+
+    uint32_t csize = GET_SIZE(HDRP(bp));   
+    uint32_t zero = GET_ZERO(HDRP(bp));
+
+    zero_placed = zero;
+    gc_placed += asize;
+    seg_remove(bp);
+    if ((csize - asize) >= MIN_BLOCK) { 
+	PUT(HDRP(bp), PACK(asize, 1));
+	PUT(FTRP(bp), PACK(asize, 1));
+	bp = NEXT_BLKP(bp);
+	PUT(HDRP(bp), PACK(csize-asize, zero));
+	PUT(FTRP(bp), PACK(csize-asize, zero));
+	seg_insert(bp);
+    }
+    else { 
+    PUT(HDRP(bp), PACK(csize, 1));
+	PUT(FTRP(bp), PACK(csize, 1));
+    }
+
+}
+/* $end mmplace */
+
+/*
+ * policy_for - Placement policy for a block of asize bytes
+ */
+static int policy_for(size_t asize)
+{
+    int policy = fit_policy;
+
+    /* huge page mode packs small blocks at the bottom of the heap */
+    if ((heap_flags & MM_HUGEPAGE) && asize <= HP_SMALL)
+	policy = MM_AOFF;
+    /* the implicit list mixes lifetime regions */
+    if ((policy == MM_NEXT_FIT || policy == MM_AOFF)
+	&& (nregions > 1 || cur_life != MM_LIFE_DEFAULT))
+	policy = MM_FIRST_FIT;
+    return policy;
+}
+
+/* 
+ * find_fit - Find a fit for a block with asize bytes 
+ */
+static void *find_fit(size_t asize)
+{
+    switch (policy_for(asize)) {
+    case MM_FIRST_FIT:
+	return find_seg_fit(asize, 1);
+    case MM_BEST_FIT:
+	return find_seg_fit(asize, 0);
+    case MM_GOOD_FIT:
+	return find_seg_fit(asize, fit_k);
+    case MM_AOFF:
+	return find_first_fit(asize);
+    default:
+	return find_next_fit(asize);
+    }
+}
+
+/*
+ * find_next_fit - Next fit from next_fit_ptr
+ */
+static void *find_next_fit(size_t asize)
+{ 
+/*  NEXT FIT IMPLEMENTATION */
+   
+     char *bp = next_fit_ptr;
+
+// unused global_bfree optimization 
+/*    if ((global_bfree) && (!GET_ALLOC(HDRP(global_bfree))) && (asize <= GET_SIZE(HDRP(global_bfree)))) {
+         char *free = global_bfree;
+         global_bfree = NULL;
+         return free;
+    }
+*/  
+  
+    /* starting at next_fit_ptr, search for free block of at least asize */
+    for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+    fit_visits++;
+    if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp)))) {
       	 next_fit_ptr = bp;  
 		 return bp;
 		}
@@ -362,6 +1635,521 @@ static void *find_fit(size_t asize)
 */
 }
 
+/*
+ * malloc_cacheline - Allocate a block whose payload owns whole cache lines
+ */
+static void *malloc_cacheline(size_t size)
+{
+    malloc_count++;
+    return malloc_aligned(LINED_SIZE(size), CACHELINE);
+}
+
+/*
+ * lined - Whether bp's block has cache lines to itself: its payload
+ *         starts a line and is whole lines, but for a scrap too small
+ *         to have been split off. mm_realloc and mm_try_expand resize
+ *         such blocks by whole lines, so they stay isolated whether
+ *         MM_CACHELINE was set for the heap or for the one call.
+ */
+static int lined(char *bp)
+{
+    return (uintptr_t)bp % CACHELINE == 0
+	&& (GET_SIZE(HDRP(bp)) - OVERHEAD) % CACHELINE < MIN_BLOCK;
+}
+
+/*
+ * malloc_aligned - Allocate a block of asize bytes whose payload is
+ *                  align-aligned
+ */
+static void *malloc_aligned(size_t asize, size_t align)
+{
+    char *bp;
+
+    /* growing for a large alignment wastes up to align bytes, so search
+       the rest of the heap too (a miss restarts next fit at the bottom) */
+    if ((bp = find_aligned_fit(asize, align)) == NULL && align > CACHELINE)
+	bp = find_aligned_fit(asize, align);
+    if (bp == NULL && collect(asize))
+	bp = find_aligned_fit(asize, align);
+    if (bp == NULL && relieve(asize))
+	bp = find_aligned_fit(asize, align);
+    if (bp == NULL) {
+	/* room for asize even after splitting off a leading free block */
+	if ((bp = grow_heap(asize + align + MIN_BLOCK)) == NULL)
+	    return NULL;
+    }
+    bp = place_aligned(bp, asize, align);
+    next_fit_ptr = NEXT_BLKP(bp);
+    return bp;
+}
+
+/*
+ * aligned_in - Return the first align-aligned payload address in free
+ *              block bp that can hold asize, or NULL. Anything skipped at
+ *              the front must be big enough to stand as a free block.
+ */
+static char *aligned_in(void *bp, size_t asize, size_t align)
+{
+    uintptr_t a = ALIGN_UP((uintptr_t)bp, align);
+
+    if (a != (uintptr_t)bp)
+	a = ALIGN_UP((uintptr_t)bp + MIN_BLOCK, align);
+    if (a + asize > (uintptr_t)bp + GET_SIZE(HDRP(bp)))
+	return NULL;
+    return (char *)a;
+}
+
+/*
+ * find_aligned_fit - Next fit for asize bytes at an align-aligned payload
+ */
+static void *find_aligned_fit(size_t asize, size_t align)
+{
+    char *bp = next_fit_ptr;
+
+    for (; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+	if (!GET_ALLOC(HDRP(bp)) && aligned_in(bp, asize, align)
+	    && (nregions == 1 || region_of(bp) == cur_life))
+	    return bp;
+
+    next_fit_ptr = heap_listp;
+    return NULL;
+}
+
+/*
+ * place_aligned - Split a free block off the front of bp so the payload
+ *                 is align-aligned, then place asize bytes there
+ */
+static void *place_aligned(void *bp, size_t asize, size_t align)
+{
+    char *a = aligned_in(bp, asize, align);
+    uint32_t csize = GET_SIZE(HDRP(bp));
+    uint32_t zero = GET_ZERO(HDRP(bp));
+    uint32_t lead = a - (char *)bp;
+
+    if (lead) {
+	seg_remove(bp);
+	PUT(HDRP(bp), PACK(lead, zero));
+	PUT(FTRP(bp), PACK(lead, zero));
+	PUT(HDRP(a), PACK(csize-lead, zero));
+	PUT(FTRP(a), PACK(csize-lead, zero));
+	seg_insert(bp);
+	seg_insert(a);
+    }
+    place(a, asize);
+    return a;
+}
+
+/*
+ * pm_malloc - Take the lowest free slot of a span of size's class
+ */
+static void *pm_malloc(size_t size)
+{
+    int cls = PM_CLASS(size);
+    struct span *s = pm_partial[cls];
+    uint32_t w, i;
+
+    if (s == NULL && (s = span_new(cls)) == NULL)
+	return NULL;
+
+    for (w = 0; s->freemap[w] == 0; w++)
+	;
+    i = w * 64 + __builtin_ctzll(s->freemap[w]);
+    s->freemap[w] &= s->freemap[w] - 1;
+    zero_placed = 0;    /* span slots are reused without clearing */
+
+    /* full spans leave the class list until something is freed */
+    if (--s->nfree == 0) {
+	pm_partial[cls] = s->next;
+	if (s->next)
+	    s->next->prev = NULL;
+    }
+    return s->start + i * s->size;
+}
+
+/*
+ * pm_free - Mark an object's slot free in its span's descriptor
+ */
+static void pm_free(struct span *s, void *bp)
+{
+    uint32_t i = ((char *)bp - s->start) / s->size;
+    uint64_t bit = (uint64_t)1 << (i % 64);
+
+    if (s->freemap[i / 64] & bit)
+	return;     /* double free */
+    s->freemap[i / 64] |= bit;
+
+    if (s->nfree++ == 0) {
+	s->prev = NULL;
+	s->next = pm_partial[s->cls];
+	if (s->next)
+	    s->next->prev = s;
+	pm_partial[s->cls] = s;
+    }
+    /* keep one span per class around to avoid thrashing on a boundary */
+    if (s->nfree == s->nobjs && (s->prev || s->next))
+	span_release(s);
+}
+
+/*
+ * pm_lookup - Span holding bp, or NULL if bp is not a span object
+ */
+static struct span *pm_lookup(void *bp)
+{
+    uintptr_t page = ((char *)bp - pm_base) >> PM_SHIFT;
+    struct span **leaf;
+
+    if (page >= (uintptr_t)PM_FANOUT * PM_FANOUT)
+	return NULL;
+    leaf = pagemap[page >> PM_BITS];
+    return leaf ? leaf[page & (PM_FANOUT-1)] : NULL;
+}
+
+/*
+ * pm_set - Map the page at p to span s, making the leaf if needed
+ */
+static int pm_set(char *p, struct span *s)
+{
+    uintptr_t page = (p - pm_base) >> PM_SHIFT;
+    struct span ***leaf = &pagemap[page >> PM_BITS];
+
+    if (*leaf == NULL) {
+	if (s == NULL)
+	    return 0;
+	/* leaves are bigger than PM_MAXSMALL, so this is a plain block */
+	self_alloc++;
+	*leaf = mm_malloc(PM_FANOUT * sizeof(struct span *));
+	self_alloc--;
+	if (*leaf == NULL)
+	    return -1;
+	memset(*leaf, 0, PM_FANOUT * sizeof(struct span *));
+    }
+    (*leaf)[page & (PM_FANOUT-1)] = s;
+    return 0;
+}
+
+/*
+ * span_new - Carve a fresh page-aligned span into objects of class cls;
+ *            the descriptor follows the last object
+ */
+static struct span *span_new(int cls)
+{
+    uint32_t asize = ALIGN_UP(PM_SPAN + sizeof(struct span), DSIZE) + OVERHEAD;
+    struct span *s;
+    char *bp;
+    uint32_t i;
+
+    self_alloc++;
+    bp = malloc_aligned(asize, PM_PAGE);
+    self_alloc--;
+    if (bp == NULL)
+	return NULL;
+
+    s = (struct span *)(bp + PM_SPAN);
+    s->start = bp;
+    s->cls = cls;
+    s->size = PM_CLASS_SIZE(cls);
+    s->nobjs = s->nfree = PM_SPAN / s->size;
+    memset(s->freemap, 0, sizeof(s->freemap));
+    for (i = 0; i < s->nobjs; i++)
+	s->freemap[i / 64] |= (uint64_t)1 << (i % 64);
+
+    for (i = 0; i < PM_SPAN; i += PM_PAGE) {
+	if (pm_set(bp + i, s) < 0) {
+	    while (i > 0)
+		pm_set(bp + (i -= PM_PAGE), NULL);
+	    mm_free(bp);
+	    return NULL;
+	}
+    }
+
+    s->prev = NULL;
+    s->next = pm_partial[cls];
+    if (s->next)
+	s->next->prev = s;
+    pm_partial[cls] = s;
+    pm_spans++;
+    return s;
+}
+
+/*
+ * span_release - Unmap an empty span and free its block
+ */
+static void span_release(struct span *s)
+{
+    uint32_t i;
+
+    if (s->prev)
+	s->prev->next = s->next;
+    else
+	pm_partial[s->cls] = s->next;
+    if (s->next)
+	s->next->prev = s->prev;
+
+    for (i = 0; i < PM_SPAN; i += PM_PAGE)
+	pm_set(s->start + i, NULL);
+    pm_spans--;
+    mm_free(s->start);
+}
+
+/*
+ * find_first_fit - First fit from the bottom of the heap
+ */
+static void *find_first_fit(size_t asize)
+{
+    char *bp;
+
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+	fit_visits++;
+	if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp))))
+	    return bp;
+    }
+    return NULL;
+}
+
+/*
+ * find_seg_fit - Smallest fitting block among the first k that fit, or
+ *                among all of them if k is 0, searching the free lists from
+ *                asize's size range up. Every block in a higher range is
+ *                bigger than any in a lower one, so the search ends with
+ *                the first range that has a fit; an exact fit ends it too.
+ */
+static void *find_seg_fit(size_t asize, int k)
+{
+    char *bp, *best = NULL;
+    uint32_t size, best_size = 0;
+    int i;
+
+    for (i = seg_index(asize); i < SEG_LISTS && best == NULL; i++) {
+	for (bp = FROM_LINK(seg_lists[cur_life][i]); bp; bp = FROM_LINK(NEXT_FREE(bp))) {
+	    fit_visits++;
+	    if ((size = GET_SIZE(HDRP(bp))) < asize)
+		continue;
+	    if (best == NULL || size < best_size) {
+		best = bp;
+		best_size = size;
+		if (size == asize)
+		    return best;
+	    }
+	    if (k && --k == 0)
+		return best;
+	}
+    }
+    return best;
+}
+
+/*
+ * class_init - Fill the size class tables from the arithmetic they replace
+ */
+static void class_init(void)
+{
+    uint32_t d, size;
+    int i;
+
+    for (d = 0; d <= SMALL_MAX/DSIZE; d++) {
+	size = d * DSIZE;
+	small_asize[d] = size <= MIN_BLOCK - OVERHEAD ? MIN_BLOCK
+						      : size + OVERHEAD;
+	i = size <= DSIZE ? 0 : 31 - __builtin_clz(size - 1) - 3;
+	small_seg[d] = i > 0 ? i : 0;
+    }
+}
+
+/*
+ * adjust_size - Block size for a request of size bytes: payload, header
+ *               and footer, doubleword aligned, at least MIN_BLOCK;
+ *               size is at most MAX_REQUEST
+ */
+static uint32_t adjust_size(size_t size)
+{
+#ifndef MM_CLASS_ARITH
+    if (size <= SMALL_MAX)
+	return small_asize[(size + DSIZE-1) / DSIZE];
+#else
+    if (size <= MIN_BLOCK - OVERHEAD)
+	return MIN_BLOCK;
+#endif
+    return ALIGN_UP(size + OVERHEAD, DSIZE);
+}
+
+/*
+ * seg_index - Free list for blocks of size bytes
+ */
+static int seg_index(uint32_t size)
+{
+    int i;
+
+#ifndef MM_CLASS_ARITH
+    if (size <= SMALL_MAX)
+	return small_seg[size / DSIZE];
+#endif
+    i = 31 - __builtin_clz(size - 1) - 3;   /* 16 -> 0, 17..32 -> 1 */
+    return i < SEG_LISTS ? i : SEG_LISTS - 1;
+}
+
+/*
+ * seg_insert - Put free block bp on the front of its free list
+ */
+static void seg_insert(void *bp)
+{
+    link_t *head = &seg_lists[region_of(bp)][seg_index(GET_SIZE(HDRP(bp)))];
+
+    NEXT_FREE(bp) = *head;
+    PREV_FREE(bp) = TO_LINK(NULL);
+    if (*head)
+	PREV_FREE(FROM_LINK(*head)) = TO_LINK(bp);
+    *head = TO_LINK(bp);
+}
+
+/*
+ * seg_remove - Take free block bp off its free list
+ */
+static void seg_remove(void *bp)
+{
+    char *next = FROM_LINK(NEXT_FREE(bp));
+    char *prev = FROM_LINK(PREV_FREE(bp));
+
+    if (prev)
+	NEXT_FREE(prev) = NEXT_FREE(bp);
+    else
+	seg_lists[region_of(bp)][seg_index(GET_SIZE(HDRP(bp)))] = NEXT_FREE(bp);
+    if (next)
+	PREV_FREE(next) = PREV_FREE(bp);
+}
+
+/*
+ * seg_sort - Merge sort the free list starting at head by address,
+ *            following next links; returns the new head
+ */
+static link_t seg_sort(link_t head)
+{
+    char *slow, *fast, *a, *b;
+    link_t rest, *tail = &head;
+
+    if (!head || !NEXT_FREE(FROM_LINK(head)))
+	return head;
+
+    /* split after the middle block */
+    slow = FROM_LINK(head);
+    for (fast = FROM_LINK(NEXT_FREE(slow)); fast && NEXT_FREE(fast);
+	 fast = FROM_LINK(NEXT_FREE(FROM_LINK(NEXT_FREE(fast)))))
+	slow = FROM_LINK(NEXT_FREE(slow));
+    rest = NEXT_FREE(slow);
+    NEXT_FREE(slow) = TO_LINK(NULL);
+
+    a = FROM_LINK(seg_sort(head));
+    b = FROM_LINK(seg_sort(rest));
+    while (a && b) {
+	if (a < b) {
+	    *tail = TO_LINK(a);
+	    tail = &NEXT_FREE(a);
+	    a = FROM_LINK(NEXT_FREE(a));
+	}
+	else {
+	    *tail = TO_LINK(b);
+	    tail = &NEXT_FREE(b);
+	    b = FROM_LINK(NEXT_FREE(b));
+	}
+    }
+    *tail = TO_LINK(a ? a : b);
+    return head;
+}
+
+/*
+ * region_of - Lifetime class of the region holding bp
+ */
+static int region_of(void *bp)
+{
+    int lo = 0, hi = nregions - 1, mid;
+
+    while (lo < hi) {
+	mid = (lo + hi + 1) / 2;
+	if (regions[mid].start <= (char *)bp)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return regions[lo].life;
+}
+
+/*
+ * needs_fence - Would growing the heap now start a new region?
+ */
+static int needs_fence(void)
+{
+    /* with the table full, the top region takes every class */
+    return cur_life != regions[nregions-1].life && nregions < MAX_REGIONS;
+}
+
+/*
+ * malloc_auto - mm_malloc in the class predicted for the call site,
+ *               sampling one call in LIFE_RATE
+ */
+static void *malloc_auto(size_t size, void *site)
+{
+    struct life_site *s = NULL;
+    struct life_sample *smp;
+    unsigned i, h = PTR_HASH(site, LIFE_SITES);
+    void *bp;
+
+    for (i = 0; i < LIFE_SITES; i++) {
+	s = &life_sites[(h + i) & (LIFE_SITES-1)];
+	if (s->site == site)
+	    break;
+	if (s->site == NULL) {
+	    s->site = site;
+	    s->life = MM_LIFE_LONG;     /* until shown otherwise */
+	    break;
+	}
+    }
+    if (i == LIFE_SITES)
+	s = NULL;   /* table full; untracked sites are long-lived */
+
+    cur_life = s ? s->life : MM_LIFE_LONG;
+    bp = mm_malloc(size);
+    cur_life = MM_LIFE_DEFAULT;
+
+    if (bp && s && ++s->calls % LIFE_RATE == 0) {
+	smp = &life_samples[PTR_HASH(bp, LIFE_SAMPLES)];
+	if (smp->bp)
+	    life_learn(smp->site, 0);   /* outlived its slot */
+	else
+	    life_nsampled++;
+	smp->bp = bp;
+	smp->site = s;
+	smp->born = malloc_count;
+    }
+    return bp;
+}
+
+/*
+ * life_freed - If bp was sampled, record how long it lived
+ */
+static void life_freed(void *bp)
+{
+    struct life_sample *smp = &life_samples[PTR_HASH(bp, LIFE_SAMPLES)];
+
+    if (smp->bp != bp)
+	return;
+    life_learn(smp->site, malloc_count - smp->born < LIFE_SHORT);
+    smp->bp = NULL;
+    life_nsampled--;
+}
+
+/*
+ * life_learn - Add one sample to a site and reclassify it
+ */
+static void life_learn(struct life_site *s, int is_short)
+{
+    s->samples++;
+    s->shorts += is_short;
+    if (s->samples >= LIFE_DECAY) {
+	s->samples /= 2;
+	s->shorts /= 2;
+    }
+    if (s->samples >= LIFE_MIN)
+	s->life = 2 * s->shorts > s->samples ? MM_LIFE_SHORT : MM_LIFE_LONG;
+}
+
 /*
  * coalesce - boundary tag coalescing. Return ptr to coalesced block
  */
@@ -370,18 +2158,28 @@ static void *coalesce(void *bp)
     uint32_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
     uint32_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
     uint32_t size = GET_SIZE(HDRP(bp));
+    uint32_t zero = GET_ZERO(HDRP(bp));
+    char *mid;                  /* bp before merging into its predecessor */
 
     if (prev_alloc && next_alloc) {            /* Case 1 */
+	seg_insert(bp);
 	return bp;
     }
 
     else if (prev_alloc && !next_alloc) {      /* Case 2 */
+	seg_remove(NEXT_BLKP(bp));
 	size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+	zero &= GET_ZERO(HDRP(NEXT_BLKP(bp)));
 
 //   char *next = NEXT_BLKP(bp);
     
-	PUT(HDRP(bp), PACK(size, 0));
-	PUT(FTRP(bp), PACK(size, 0));
+	if (zero) {     /* the tags and links between the two become payload */
+	    memset(NEXT_BLKP(bp), 0, 2*sizeof(link_t));
+	    PUT(HDRP(NEXT_BLKP(bp)), 0);
+	    PUT(FTRP(bp), 0);
+	}
+	PUT(HDRP(bp), PACK(size, zero));
+	PUT(FTRP(bp), PACK(size, zero));
 
 // if (global_bfree == next)
 //   global_bfree = bp;
@@ -389,35 +2187,338 @@ static void *coalesce(void *bp)
     }
 
     else if (!prev_alloc && next_alloc) {      /* Case 3 */
+	seg_remove(PREV_BLKP(bp));
 	size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+	zero &= GET_ZERO(HDRP(PREV_BLKP(bp)));
 
-	PUT(FTRP(bp), PACK(size, 0));
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+	PUT(FTRP(bp), PACK(size, zero));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, zero));
+	mid = bp;
 	bp = PREV_BLKP(bp);
+	if (zero) {
+	    memset(mid, 0, 2*sizeof(link_t));
+	    PUT(HDRP(mid) - WSIZE, 0);
+	    PUT(HDRP(mid), 0);
+	}
     
    }
 
     else {                                     /* Case 4 */
 
+	seg_remove(PREV_BLKP(bp));
+	seg_remove(NEXT_BLKP(bp));
 	size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
 	 GET_SIZE(FTRP(NEXT_BLKP(bp)));
+	zero &= GET_ZERO(HDRP(PREV_BLKP(bp))) & GET_ZERO(HDRP(NEXT_BLKP(bp)));
 
 //   char *next = NEXT_BLKP(bp);
 
-	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, zero));
+	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, zero));
+	mid = bp;
 	bp = PREV_BLKP(bp);
+	if (zero) {
+	    memset(NEXT_BLKP(mid), 0, 2*sizeof(link_t));
+	    memset(mid, 0, 2*sizeof(link_t));
+	    PUT(HDRP(NEXT_BLKP(mid)), 0);
+	    PUT(FTRP(mid), 0);
+	    PUT(HDRP(mid) - WSIZE, 0);
+	    PUT(HDRP(mid), 0);
+	}
 
 //   if (next == global_bfree)
 //     global_bfree = bp;
 	
     }
+    seg_insert(bp);
 
 /* good chance of having large freed block, so set nfp to coalesced block */
     next_fit_ptr = bp;
+    /* the verifier's cursor may have been on a block merged away */
+    if (verify_cursor > (char *)bp && verify_cursor < NEXT_BLKP(bp))
+	verify_cursor = bp;
     return bp;
 }
 
+/*
+ * mm_heap_analyze - Fill r with the heap's block statistics and, if path
+ *                   is not NULL, write its run-length map there; returns
+ *                   -1 if the map could not be written
+ */
+int mm_heap_analyze(struct mm_heap_report *r, const char *path)
+{
+    char *lo = mem_heap_lo(), *run = lo, *bp;
+    FILE *f = NULL;
+    uint32_t size;
+    int alloc = 1, bin, rc = 0;
+
+    memset(r, 0, sizeof(*r));
+    r->heap_bytes = mem_heapsize();
+    if (path) {
+	if ((f = fopen(path, "w")) == NULL)
+	    return -1;
+	fprintf(f, "mmheap %zu\n", r->heap_bytes);
+    }
+
+    for (bp = heap_listp; (size = GET_SIZE(HDRP(bp))) > 0; bp = NEXT_BLKP(bp)) {
+	if (GET_ALLOC(HDRP(bp))) {
+	    r->alloc_blocks++;
+	    r->alloc_bytes += size;
+	}
+	else {
+	    r->free_blocks++;
+	    r->free_bytes += size;
+	    r->largest_free = MAX(r->largest_free, size);
+	    for (bin = 0; bin < MM_HIST_BINS - 1 && size >> (bin + 1); bin++)
+		;
+	    r->free_hist[bin]++;
+	    r->free_hist_bytes[bin] += size;
+	}
+	/* a run ends where the allocation state changes */
+	if (f && GET_ALLOC(HDRP(bp)) != alloc) {
+	    fprintf(f, "%c %ld\n", alloc ? 'a' : 'f', (long)(HDRP(bp) - run));
+	    run = HDRP(bp);
+	    alloc = !alloc;
+	}
+    }
+    if (r->free_bytes)
+	r->frag = 1 - (double)r->largest_free / r->free_bytes;
+
+    if (f) {
+	/* the last run takes the epilogue, if it is allocated already */
+	if (!alloc) {
+	    fprintf(f, "f %ld\n", (long)(HDRP(bp) - run));
+	    run = HDRP(bp);
+	}
+	fprintf(f, "a %ld\n", (long)(lo + r->heap_bytes - run));
+	if (ferror(f))
+	    rc = -1;
+	if (fclose(f) != 0)
+	    rc = -1;
+    }
+    return rc;
+}
+
+/*
+ * verify_due - Whether this call is one the verifier samples
+ */
+static int verify_due(void)
+{
+    if (!verify_budget || ++verify_tick < verify_period)
+	return 0;
+    verify_tick = 0;
+    return 1;
+}
+
+/*
+ * verify_step - Check the next n blocks after the cursor
+ */
+static void verify_step(int n)
+{
+    char *hi = (char *)mem_heap_hi() + 1;
+
+    while (n-- > 0) {
+	if (GET_SIZE(HDRP(verify_cursor)) == 0) {
+	    if (verify_cursor != hi)
+		verify_errors++;        /* bad epilogue */
+	    verify_cursor = heap_listp;
+	    continue;
+	}
+	verify_block(verify_cursor);
+	if (NEXT_BLKP(verify_cursor) > hi) {
+	    verify_cursor = heap_listp; /* size is garbage; start over */
+	    continue;
+	}
+	verify_cursor = NEXT_BLKP(verify_cursor);
+    }
+}
+
+/*
+ * verify_block - Count what is wrong with block bp
+ */
+static void verify_block(char *bp)
+{
+    uint32_t size = GET_SIZE(HDRP(bp));
+    char *next, *prev;
+
+    if ((uintptr_t)bp % DSIZE)
+	verify_errors++;
+    if (GET(HDRP(bp)) != GET(FTRP(bp)))
+	verify_errors++;
+    if (size < MIN_BLOCK && !(size == OVERHEAD && GET_ALLOC(HDRP(bp))))
+	verify_errors++;        /* only the prologue and fences are smaller */
+    if (GET_ALLOC(HDRP(bp))) {
+	if (GET_ZERO(HDRP(bp)))
+	    verify_errors++;
+	return;
+    }
+
+    if (!GET_ALLOC(HDRP(NEXT_BLKP(bp))))
+	verify_errors++;        /* missed coalescing */
+    next = FROM_LINK(NEXT_FREE(bp));
+    prev = FROM_LINK(PREV_FREE(bp));
+    if (next && FROM_LINK(PREV_FREE(next)) != bp)
+	verify_errors++;
+    if (prev ? FROM_LINK(NEXT_FREE(prev)) != bp
+	: FROM_LINK(seg_lists[region_of(bp)][seg_index(size)]) != bp)
+	verify_errors++;
+}
+
+/*
+ * verify_list - Check the first n blocks of a free list
+ */
+static void verify_list(int life, int i, int n)
+{
+    char *bp, *prev = NULL;
+    char *lo = heap_listp, *hi = (char *)mem_heap_hi() + 1;
+
+    for (bp = FROM_LINK(seg_lists[life][i]); bp && n-- > 0;
+	 bp = FROM_LINK(NEXT_FREE(bp))) {
+	if (bp <= lo || bp >= hi || (uintptr_t)bp % DSIZE) {
+	    verify_errors++;    /* a link into nowhere; stop following */
+	    return;
+	}
+	if (GET_ALLOC(HDRP(bp)) || seg_index(GET_SIZE(HDRP(bp))) != i
+	    || FROM_LINK(PREV_FREE(bp)) != prev)
+	    verify_errors++;
+	prev = bp;
+    }
+}
+
+/*
+ * gc_roots_scan - Mark from the registers, the stack, data and bss, and
+ *                 the added roots, skipping mm.c's own heap pointers
+ */
+static void gc_roots_scan(void)
+{
+    extern char __data_start[], _end[];
+    struct gc_range own[] = {   /* ascending order is not needed */
+	{ (char *)&next_fit_ptr, (char *)(&next_fit_ptr + 1) },
+	{ (char *)&verify_cursor, (char *)(&verify_cursor + 1) },
+	{ (char *)&zero_hwm, (char *)(&zero_hwm + 1) },
+	{ (char *)regions, (char *)(regions + MAX_REGIONS) },
+	{ (char *)life_samples, (char *)(life_samples + LIFE_SAMPLES) },
+    };
+    char *lo = __data_start, *hi;
+    jmp_buf regs;
+    int i;
+
+    /* callee-saved registers go to this frame, which gc_stack_scan sees */
+    __builtin_unwind_init();
+    setjmp(regs);
+    gc_stack_scan();
+
+    /* data and bss, in the gaps between our own pointers */
+    while (lo < _end) {
+	hi = _end;
+	for (i = 0; i < sizeof(own) / sizeof(own[0]); i++) {
+	    if (own[i].lo <= lo && lo < own[i].hi) {
+		lo = own[i].hi;         /* skip it and look again */
+		hi = _end;
+		i = -1;
+	    }
+	    else if (lo < own[i].lo && own[i].lo < hi)
+		hi = own[i].lo;
+	}
+	if (lo < hi)
+	    gc_scan(lo, hi);
+	lo = hi;
+    }
+
+    for (i = 0; i < gc_nroots; i++)
+	gc_scan(gc_roots[i].lo, gc_roots[i].hi);
+}
+
+/*
+ * gc_stack_scan - Mark from the stack above this frame, which holds every
+ *                 caller's locals and spilled registers
+ */
+static void gc_stack_scan(void)
+{
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    char *sp = __builtin_frame_address(0);
+
+    if (gc_stack_top == NULL && pthread_getattr_np(pthread_self(), &attr) == 0) {
+	if (pthread_attr_getstack(&attr, &addr, &size) == 0)
+	    gc_stack_top = (char *)addr + size;
+	pthread_attr_destroy(&attr);
+    }
+    if (gc_stack_top)
+	gc_scan(sp, gc_stack_top);
+}
+
+/*
+ * gc_scan - Mark every block a pointer-aligned word in [lo, hi) points into
+ */
+static void gc_scan(char *lo, char *hi)
+{
+    char **p = (char **)ALIGN_UP((uintptr_t)lo, sizeof(char *));
+
+    for (; (char *)(p + 1) <= hi; p++)
+	gc_mark(*p);
+}
+
+/*
+ * gc_mark - If p points into an allocated block's payload, mark the block
+ *           and queue it to be scanned
+ */
+static void gc_mark(char *p)
+{
+    long lo = 0, hi = gc_nblocks - 1, mid;
+    char *bp;
+
+    if (p < gc_index[0] || p >= (char *)mem_heap_hi())
+	return;
+    while (lo < hi) {           /* last block starting at or below p */
+	mid = (lo + hi + 1) / 2;
+	if (gc_index[mid] <= p)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    bp = gc_index[lo];
+    if (p >= FTRP(bp) || (GET(HDRP(bp)) & MARK))
+	return;
+    PUT(HDRP(bp), GET(HDRP(bp)) | MARK);
+    gc_stack[gc_depth++] = bp;
+}
+
+/*
+ * gc_sweep - Free the unmarked blocks and unmark the rest; returns bytes
+ *            freed, and sets gc_kept
+ */
+static size_t gc_sweep(void)
+{
+    int budget = verify_budget;
+    size_t freed = 0;
+    char *bp, *next;
+
+    verify_budget = 0;          /* marks ahead of the sweep look wrong */
+    gc_kept = 0;
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = next) {
+	next = NEXT_BLKP(bp);
+	if (!GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) <= OVERHEAD)
+	    continue;
+	if (GET(HDRP(bp)) & MARK) {
+	    PUT(HDRP(bp), GET(HDRP(bp)) & ~MARK);
+	    gc_kept += GET_SIZE(HDRP(bp));
+	    continue;
+	}
+	if (pm_spans && pm_lookup(bp)) {
+	    gc_kept += GET_SIZE(HDRP(bp));
+	    continue;           /* spans live as long as the page map */
+	}
+	/* the free merges bp with a free successor; step over both */
+	if (!GET_ALLOC(HDRP(next)))
+	    next = NEXT_BLKP(next);
+	freed += GET_SIZE(HDRP(bp));
+	mm_free(bp);
+    }
+    verify_budget = budget;
+    return freed;
+}
 
 static void printblock(void *bp) 
 {
@@ -0,0 +1,163 @@
+/*
+ * mm_bg.c - deferred frees and a background maintenance thread over mm.c
+ *
+ * mm_free coalesces, and under mm_lock that work lands on whichever
+ * request thread happens to free. Here mm_bg_free only pushes the object
+ * onto a lock-free deferred list, linked through the objects themselves,
+ * and a maintenance thread does the rest:
+ *
+ *   - every BG_TICK it takes the whole deferred list with one exchange and
+ *     frees it into mm.c, BG_BATCH objects per hold of mm_lock so request
+ *     threads waiting in mm_bg_malloc are not stalled behind a long batch
+ *   - after BG_IDLE_SORT quiet ticks it sorts every free list by address,
+ *     so first fit on the lists behaves like address-ordered first fit
+ *     until new frees land on the fronts again
+ *   - after BG_IDLE_TRIM quiet ticks it releases the free pages (mm_trim)
+ *
+ * Only the maintenance thread takes from the deferred list, and it takes
+ * all of it at once, so pushes need no ABA protection. If mm_bg_malloc
+ * finds no memory it drains the deferred list itself and tries again,
+ * rather than failing while frees are queued, and the deferred list is
+ * drained the same way when mm.c nears its soft limit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "mm_bg.h"
+
+#define BG_TICK       1000000L  /* ns between passes */
+#define BG_BATCH      64        /* frees per hold of mm_lock */
+#define BG_IDLE_SORT  10        /* quiet ticks before sorting free lists */
+#define BG_IDLE_TRIM  100       /* quiet ticks before trimming */
+
+static void *deferred;          /* objects waiting to be freed */
+static int running;
+static int registered;          /* drain is a pressure callback */
+static pthread_t bg_thread;
+
+/* function prototypes for internal helper routines */
+static void *bg_main(void *vargp);
+static int drain(void);
+static void bg_pressure(void *arg);
+
+/*
+ * mm_bg_start - Start the maintenance thread
+ */
+int mm_bg_start(void)
+{
+    if (running)
+	return 0;
+    if (!registered) {
+	mm_lock();
+	mm_on_pressure(bg_pressure, NULL);
+	mm_unlock();
+	registered = 1;
+    }
+    running = 1;
+    if (pthread_create(&bg_thread, NULL, bg_main, NULL) != 0) {
+	running = 0;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * mm_bg_stop - Stop the maintenance thread and finish the deferred frees
+ */
+void mm_bg_stop(void)
+{
+    if (!running)
+	return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(bg_thread, NULL);
+    drain();
+}
+
+void *mm_bg_malloc(size_t size)
+{
+    void *p;
+    int relieved;
+
+    mm_lock();
+    p = mm_malloc(size);
+    relieved = mm_unlock();
+    if (p == NULL && (drain() || relieved)) {
+	mm_lock();
+	p = mm_malloc(size);
+	mm_unlock();
+    }
+    return p;
+}
+
+/*
+ * mm_bg_free - Push ptr onto the deferred list
+ */
+void mm_bg_free(void *ptr)
+{
+    void *head;
+
+    if (ptr == NULL)
+	return;
+    head = __atomic_load_n(&deferred, __ATOMIC_RELAXED);
+    do {
+	*(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&deferred, &head, ptr, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * bg_main - Free deferred objects each tick; sort and trim when idle
+ */
+static void *bg_main(void *vargp)
+{
+    struct timespec tick = { 0, BG_TICK };
+    int idle = 0;
+
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+	if (drain()) {
+	    idle = 0;
+	}
+	else if (++idle == BG_IDLE_SORT) {
+	    mm_lock();
+	    mm_sort_free_lists();
+	    mm_unlock();
+	}
+	else if (idle == BG_IDLE_TRIM) {
+	    mm_lock();
+	    mm_trim();
+	    mm_unlock();
+	}
+	nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+static void bg_pressure(void *arg)
+{
+    drain();
+}
+
+/*
+ * drain - Free everything on the deferred list; returns objects freed
+ */
+static int drain(void)
+{
+    void *p = __atomic_exchange_n(&deferred, NULL, __ATOMIC_ACQUIRE);
+    int n = 0, i;
+
+    while (p) {
+	mm_lock();
+	for (i = 0; p && i < BG_BATCH; i++, n++) {
+	    void *next = *(void **)p;
+
+	    mm_free(p);
+	    p = next;
+	}
+	mm_unlock();
+    }
+    return n;
+}
@@ -0,0 +1,22 @@
+#ifndef MM_BG_H
+#define MM_BG_H
+
+/*
+ * mm_bg.h - deferred frees and a background maintenance thread over mm.c
+ *           (see mm_bg.c)
+ */
+
+#include <stddef.h>
+
+/* start the maintenance thread; 0 on success */
+int mm_bg_start(void);
+
+/* stop it, after it has finished every deferred free */
+void mm_bg_stop(void);
+
+void *mm_bg_malloc(size_t size);
+
+/* queue ptr for the maintenance thread to free */
+void mm_bg_free(void *ptr);
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef MM_EXT_H
+#define MM_EXT_H
+
+/*
+ * mm_ext.h - extensions to the mm.h interface, implemented in mm.c
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+
+/* Flags for mm_malloc_flags and mm_set_flags */
+#define MM_CACHELINE    0x1  /* payload gets whole cache lines to itself */
+#define MM_PREFAULT     0x2  /* fault in new heap chunks as they are added */
+#define MM_FIXED_CHUNK  0x4  /* grow by fixed CHUNKSIZE, not adaptively */
+#define MM_PAGEMAP      0x8  /* small objects in spans, sizes in a page map */
+#define MM_HUGEPAGE     0x10 /* grow in 2MB-aligned units, pack small blocks */
+#define MM_LIFETIME     0x20 /* predict lifetime classes from call sites */
+#define MM_GC           0x40 /* collect garbage before the heap grows */
+#define MM_REALLOC_GROW 0x80 /* over-reserve blocks realloc keeps growing */
+#define MM_LATENCY      0x100 /* histogram malloc latency per size class */
+
+/* Lifetime classes for mm_malloc_hint */
+#define MM_LIFE_DEFAULT 0
+#define MM_LIFE_SHORT   1    /* freed soon after allocation */
+#define MM_LIFE_LONG    2    /* lives for much of the run */
+
+/* Placement policies for mm_set_policy */
+#define MM_NEXT_FIT     0    /* resume after the last placement (default) */
+#define MM_FIRST_FIT    1    /* first block that fits */
+#define MM_BEST_FIT     2    /* smallest block that fits */
+#define MM_GOOD_FIT     3    /* smallest of the first k blocks that fit */
+#define MM_AOFF         4    /* lowest-addressed block that fits */
+
+/* Heap growth counters, reset by mm_init */
+struct mm_stats {
+    unsigned long sbrk_calls;     /* mem_sbrk calls that succeeded */
+    unsigned long sbrk_bytes;     /* bytes added to the heap */
+    unsigned long prefault_pages; /* pages faulted in by MM_PREFAULT */
+    unsigned long trim_bytes;     /* bytes released by mm_trim */
+    unsigned long pressure_runs;  /* soft limit reliefs */
+    unsigned long limit_fails;    /* growths refused by the hard limit */
+    unsigned long gc_runs;        /* collections */
+    unsigned long gc_bytes;       /* bytes freed by collections */
+    long gc_ns;                   /* total collection pause (ns) */
+    long gc_max_ns;               /* longest collection pause (ns) */
+    unsigned long realloc_calls;
+    unsigned long realloc_moves;  /* reallocs that had to copy */
+    unsigned long realloc_copied; /* bytes they copied */
+    unsigned int chunksize;       /* current growth unit (bytes) */
+};
+
+#define MM_HIST_BINS    32   /* free block histogram bins, by log2 size */
+
+/* Heap shape found by mm_heap_analyze */
+struct mm_heap_report {
+    size_t heap_bytes;
+    size_t alloc_bytes;           /* in allocated blocks, tags included */
+    size_t free_bytes;
+    size_t largest_free;          /* bytes in the largest free block */
+    unsigned long alloc_blocks;
+    unsigned long free_blocks;
+    unsigned long free_hist[MM_HIST_BINS];       /* blocks of [2^i, 2^(i+1)) */
+    unsigned long free_hist_bytes[MM_HIST_BINS]; /* their bytes */
+    double frag;                  /* 1 - largest_free / free_bytes */
+};
+
+#define MM_LAT_BINS     32   /* latency histogram bins, by log2 */
+
+/* mm_malloc latency in one size class (MM_LATENCY) */
+struct mm_latency {
+    unsigned long calls;
+    unsigned int min_size, max_size;    /* block sizes seen */
+    unsigned long cycles[MM_LAT_BINS];  /* calls of [2^i, 2^(i+1)) ticks */
+    unsigned long visits[MM_LAT_BINS];  /* calls looking at [2^i - 1,
+					   2^(i+1) - 1) blocks in find_fit */
+    unsigned long long max_cycles;
+    unsigned long max_visits;
+};
+
+/* mm_malloc with per-call flags, or'ed with the heap-wide flags */
+void *mm_malloc_flags(size_t size, int flags);
+
+/* size bytes whose address is a multiple of align, a power of 2 */
+void *mm_memalign(size_t align, size_t size);
+
+/* payload bytes ptr's block has, which may exceed what was asked for */
+size_t mm_usable_size(void *ptr);
+
+/* grow ptr's block to size bytes in place, never moving it; 1 if it now
+   holds size bytes, 0 if it could not and is unchanged */
+int mm_try_expand(void *ptr, size_t size);
+
+/* mm_malloc into the heap regions of a lifetime class */
+void *mm_malloc_hint(size_t size, int life);
+
+/* release the whole pages inside free blocks; returns bytes released */
+size_t mm_trim(void);
+
+/* cap the heap at soft and hard bytes, 0 for no limit; kept across
+   mm_init. Growing past soft first runs the pressure callbacks and
+   trims; growing past hard fails the malloc */
+void mm_set_limits(size_t soft, size_t hard);
+
+/* have fn(arg) called, without mm_lock held, to free what it can when
+   the heap nears its soft limit; -1 if too many are registered. Call it
+   under mm_lock once other threads use mm.c */
+int mm_on_pressure(void (*fn)(void *), void *arg);
+
+/* conservative mark-sweep collection from the calling thread's stack
+   and registers, data and bss, and the added roots; returns bytes freed.
+   Single-threaded use only */
+size_t mm_gc(void);
+
+/* also scan [p, p+len) for pointers; -1 if too many are added */
+int mm_gc_add_root(void *p, size_t len);
+void mm_gc_remove_root(void *p);
+
+/* walk the heap and fill r; if path is not NULL also write the heap map
+   there: a line "mmheap <heap bytes>", then one line "a <bytes>" or
+   "f <bytes>" per run of allocated or free bytes, in address order.
+   -1 if the map could not be written. Call under mm_lock once other
+   threads use mm.c */
+int mm_heap_analyze(struct mm_heap_report *r, const char *path);
+
+/* put every free list in address order */
+void mm_sort_free_lists(void);
+
+/* check budget blocks on every period'th mm_malloc/mm_free call (0 for
+   the default period), budget 0 to stop; and the number of problems
+   found since mm_init */
+void mm_set_verify(int budget, int period);
+long mm_verify_errors(void);
+
+/* check the whole heap, printing each problem found; with verbose set,
+   print every block too */
+void mm_checkheap(int verbose);
+
+/* calloc; skips clearing blocks known to be zero already */
+void *mm_calloc(size_t nmemb, size_t size);
+
+/* heap-wide flags applied to every mm_malloc (and so mm_realloc) */
+void mm_set_flags(int flags);
+
+/* placement policy, kept across mm_init; k is MM_GOOD_FIT's bound */
+void mm_set_policy(int policy, int k);
+
+/* serialize calls into mm.c from multithreaded layers. mm_unlock runs
+   the pressure callbacks a malloc under the lock put off, and returns 1
+   if it did: a malloc that failed under the lock may succeed now */
+void mm_lock(void);
+int mm_unlock(void);
+
+/* copy out the heap growth counters */
+void mm_get_stats(struct mm_stats *st);
+
+/* copy out the latency histograms of up to n size classes; returns the
+   number of classes. mm_dump_latency prints them */
+int mm_get_latency(struct mm_latency *lat, int n);
+void mm_dump_latency(FILE *f);
+
+#endif
@@ -0,0 +1,252 @@
+/*
+ * mm_lf.c - lock-free shared pools for the hottest small size classes
+ *
+ * Objects up to LF_MAXSIZE bytes are binned into LF_CLASSES classes of
+ * LF_STEP bytes, and each class keeps its free objects on one Treiber
+ * stack shared by every thread: a malloc pops, a free pushes, and neither
+ * takes a lock. When a stack runs dry, the popping thread takes LF_BATCH
+ * objects from mm.c under mm_lock and pushes all but one with a single CAS.
+ * Pooled objects go back to mm.c only through mm_lf_reap, which is also
+ * mm.c's pressure callback once the pools have been filled.
+ *
+ * ABA
+ * A pop reads the top object's link, then swings the head from the top to
+ * that link. If meanwhile another thread popped the top, popped its
+ * successor and pushed the top back, a bare pointer CAS would succeed and
+ * install a successor that is no longer on the stack. So the head is one
+ * 64-bit word holding a 32-bit heap offset of the top object and a 32-bit
+ * tag bumped by every push and pop: a head that has been changed and
+ * changed back no longer compares equal. The offset form keeps the word
+ * CAS-able with a plain 64-bit cmpxchg instead of cmpxchg16b, and works
+ * because memlib's heap is one mapping far smaller than 4GB. Links in the
+ * objects are the same 32-bit offsets; offset 0 (the heap's alignment pad)
+ * ends a stack. The tag would need 2^32 operations between a pop's load
+ * and its CAS to wrap onto the same value.
+ *
+ * A pop may read the link of an object another thread has just popped and
+ * is writing; the read is atomic, the value is garbage, and the CAS then
+ * fails because the tag moved, so the garbage is never used. That holds
+ * while mm_lf_reap runs too: it pops each object like any malloc before
+ * freeing it, so the object may already be back in mm.c, but it stays
+ * mapped, since memlib's heap never shrinks (mm_trim only drops pages,
+ * which then read as zero).
+ *
+ * With mm_lf_set_locked(1) the same stacks are guarded by a mutex per
+ * class instead, so benchmarks can compare the two on equal terms.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+#include "mm_lf.h"
+
+#define LF_STEP      16     /* size class granularity (bytes) */
+#define LF_MAXSIZE   64     /* largest size served from the pools */
+#define LF_CLASSES   (LF_MAXSIZE / LF_STEP)
+#define LF_BATCH     64     /* objects taken from mm.c per refill */
+#define LF_LINE      64     /* cache line size (bytes) */
+
+/* Size to class index and class index to object size */
+#define CLASS(size)     (((size) + LF_STEP-1) / LF_STEP - 1)
+#define CLASS_SIZE(c)   (((c) + 1) * LF_STEP)
+
+/* Head word: tag in the high half, offset of the top object in the low */
+#define HEAD(tag, off)  (((uint64_t)(tag) << 32) | (off))
+#define HEAD_TAG(h)     ((uint32_t)((h) >> 32))
+#define HEAD_OFF(h)     ((uint32_t)(h))
+
+/* Offset of an object from the heap start, and back */
+#define OFF(p)          ((uint32_t)((char *)(p) - (char *)mem_heap_lo()))
+#define PTR(off)        ((char *)mem_heap_lo() + (off))
+
+/* Link word at the start of a pooled object */
+#define LINK(p)         ((uint32_t *)(p))
+
+/* One class, alone on its cache line so classes do not false-share */
+struct lf_class {
+    uint64_t head;
+    pthread_mutex_t lock;   /* used only in locked mode */
+} __attribute__((aligned(LF_LINE)));
+
+static struct lf_class classes[LF_CLASSES] = {
+    [0 ... LF_CLASSES-1] = { 0, PTHREAD_MUTEX_INITIALIZER }
+};
+static int locked;
+static pthread_once_t lf_once = PTHREAD_ONCE_INIT;
+
+/* function prototypes for internal helper routines */
+static void *pop(struct lf_class *k);
+static void push(struct lf_class *k, void *first, void *last);
+static void *refill(struct lf_class *k, size_t size);
+static void lf_init(void);
+static void lf_pressure(void *arg);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+
+/*
+ * mm_lf_malloc - Allocate size bytes, from the shared pools when small
+ */
+void *mm_lf_malloc(size_t size)
+{
+    struct lf_class *k;
+    void *p;
+
+    if (size == 0 || size > LF_MAXSIZE)
+	return heap_malloc(size);
+    k = &classes[CLASS(size)];
+    if ((p = pop(k)) == NULL)
+	p = refill(k, CLASS_SIZE(CLASS(size)));
+    return p;
+}
+
+/*
+ * mm_lf_free - Free ptr of size bytes, to the shared pools when small
+ */
+void mm_lf_free(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+	return;
+    if (size == 0 || size > LF_MAXSIZE) {
+	heap_free(ptr);
+	return;
+    }
+    push(&classes[CLASS(size)], ptr, ptr);
+}
+
+void mm_lf_set_locked(int on)
+{
+    locked = on;
+}
+
+/*
+ * mm_lf_reap - Empty every pool back into mm.c, popping each object so
+ *              that mallocs and frees may carry on meanwhile
+ */
+void mm_lf_reap(void)
+{
+    void *p;
+    int c;
+
+    for (c = 0; c < LF_CLASSES; c++)
+	while ((p = pop(&classes[c])) != NULL)
+	    heap_free(p);
+}
+
+/*
+ * pop - Take the top object off k's stack, or NULL if it is empty
+ */
+static void *pop(struct lf_class *k)
+{
+    uint64_t old, new;
+    uint32_t next;
+
+    if (locked) {
+	pthread_mutex_lock(&k->lock);
+	old = k->head;
+	if (HEAD_OFF(old))
+	    k->head = HEAD(HEAD_TAG(old) + 1, *LINK(PTR(HEAD_OFF(old))));
+	pthread_mutex_unlock(&k->lock);
+	return HEAD_OFF(old) ? PTR(HEAD_OFF(old)) : NULL;
+    }
+
+    old = __atomic_load_n(&k->head, __ATOMIC_ACQUIRE);
+    do {
+	if (HEAD_OFF(old) == 0)
+	    return NULL;
+	/* may be stale if the top was taken meanwhile; the tag catches it */
+	next = __atomic_load_n(LINK(PTR(HEAD_OFF(old))), __ATOMIC_RELAXED);
+	new = HEAD(HEAD_TAG(old) + 1, next);
+    } while (!__atomic_compare_exchange_n(&k->head, &old, new, 1,
+					  __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return PTR(HEAD_OFF(old));
+}
+
+/*
+ * push - Push the chain first..last, already linked, onto k's stack
+ */
+static void push(struct lf_class *k, void *first, void *last)
+{
+    uint64_t old, new;
+
+    if (locked) {
+	pthread_mutex_lock(&k->lock);
+	*LINK(last) = HEAD_OFF(k->head);
+	k->head = HEAD(HEAD_TAG(k->head) + 1, OFF(first));
+	pthread_mutex_unlock(&k->lock);
+	return;
+    }
+
+    old = __atomic_load_n(&k->head, __ATOMIC_RELAXED);
+    do {
+	__atomic_store_n(LINK(last), HEAD_OFF(old), __ATOMIC_RELAXED);
+	new = HEAD(HEAD_TAG(old) + 1, OFF(first));
+    } while (!__atomic_compare_exchange_n(&k->head, &old, new, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * refill - Take a batch of objects from mm.c; keep one and pool the rest
+ */
+static void *refill(struct lf_class *k, size_t size)
+{
+    char *p, *first = NULL, *last = NULL;
+    int i;
+
+    pthread_once(&lf_once, lf_init);
+    mm_lock();
+    p = mm_malloc(size);
+    for (i = 1; p && i < LF_BATCH; i++) {
+	char *q = mm_malloc(size);
+
+	if (q == NULL)
+	    break;
+	*LINK(q) = first ? OFF(first) : 0;
+	first = q;
+	if (last == NULL)
+	    last = q;
+    }
+    if (mm_unlock() && p == NULL)
+	p = heap_malloc(size);
+
+    if (first)
+	push(k, first, last);
+    return p;
+}
+
+static void lf_init(void)
+{
+    mm_lock();
+    mm_on_pressure(lf_pressure, NULL);
+    mm_unlock();
+}
+
+static void lf_pressure(void *arg)
+{
+    mm_lf_reap();
+}
+
+static void *heap_malloc(size_t size)
+{
+    void *p;
+
+    mm_lock();
+    p = mm_malloc(size);
+    if (mm_unlock() && p == NULL) {
+	/* the hard limit failed it before relief could run */
+	mm_lock();
+	p = mm_malloc(size);
+	mm_unlock();
+    }
+    return p;
+}
+
+static void heap_free(void *ptr)
+{
+    mm_lock();
+    mm_free(ptr);
+    mm_unlock();
+}
@@ -0,0 +1,23 @@
+#ifndef MM_LF_H
+#define MM_LF_H
+
+/*
+ * mm_lf.h - lock-free shared pools for the hottest small size classes
+ *           over mm.c (see mm_lf.c)
+ */
+
+#include <stddef.h>
+
+/* size must be the size passed to mm_lf_malloc */
+void *mm_lf_malloc(size_t size);
+void mm_lf_free(void *ptr, size_t size);
+
+/* guard the pools with a mutex per class instead of CAS, for comparison;
+   set while no thread is using them */
+void mm_lf_set_locked(int locked);
+
+/* return every pooled object to mm.c; safe while other threads use the
+   pools, which is how mm.c's pressure callback calls it */
+void mm_lf_reap(void);
+
+#endif
@@ -0,0 +1,410 @@
+/*
+ * mm_mag.c - Bonwick-style magazine layer for small objects over mm.c
+ *
+ * Objects up to MAG_MAXSIZE bytes are binned into size classes of
+ * MAG_STEP bytes. Every thread holds two magazines per class, loaded and
+ * previous; a magazine is a fixed-capacity stack of free objects. Most
+ * mallocs pop from loaded and most frees push to it, so they never touch
+ * mm.c or a shared lock:
+ *
+ *   malloc: loaded has rounds          pop
+ *           previous has rounds        swap loaded/previous, pop
+ *           depot has a full magazine  previous -> depot empty list,
+ *                                      loaded -> previous, full -> loaded
+ *           otherwise                  mm_malloc under mm_lock
+ *
+ *   free:   loaded has room            push
+ *           previous is empty          swap loaded/previous, push
+ *           depot has (or makes) an    previous -> depot full list,
+ *           empty magazine             loaded -> previous, empty -> loaded
+ *           otherwise                  mm_free under mm_lock
+ *
+ * The depot is per class and guarded by a short lock, taken only to
+ * exchange whole magazines. When that lock is found contended more than
+ * MAG_CONTENDED times, the class's magazine capacity doubles (up to
+ * MAG_MAX), so threads come to the depot less often. Magazines made
+ * before a resize keep their capacity while they hold rounds; when one
+ * comes back to the depot empty it is freed rather than reused, so the
+ * empty list refills at the new capacity.
+ *
+ * The cache is bounded: each thread holds at most two magazines per class
+ * and the depot keeps at most MAG_DEPOT_FULL full magazines per class;
+ * rounds beyond that go straight back to mm.c. mm_mag_reap empties every
+ * thread's magazines and the depot, and a thread's magazines go to the
+ * depot when it exits. Each thread cache has its own lock, uncontended
+ * except while mm_mag_reap flushes it, like Bonwick's per-CPU locks.
+ * mm_mag_reap is also mm.c's pressure callback, so the caches empty
+ * before the heap grows past its soft limit.
+ *
+ * Magazines and thread caches are bookkeeping, not objects, so they come
+ * from libc and survive mm_init.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "mm.h"
+#include "mm_ext.h"
+#include "mm_mag.h"
+
+#define MAG_STEP        16      /* size class granularity (bytes) */
+#define MAG_MAXSIZE     256     /* largest size served from magazines */
+#define MAG_CLASSES     (MAG_MAXSIZE / MAG_STEP)
+#define MAG_MIN         4       /* initial magazine capacity */
+#define MAG_MAX         64      /* largest magazine capacity */
+#define MAG_CONTENDED   16      /* depot lock contentions before growing */
+#define MAG_DEPOT_FULL  32      /* full magazines kept per class */
+
+/* Size to class index and class index to object size */
+#define CLASS(size)     (((size) + MAG_STEP-1) / MAG_STEP - 1)
+#define CLASS_SIZE(c)   (((c) + 1) * MAG_STEP)
+
+struct magazine {
+    struct magazine *next;  /* depot list link */
+    int rounds;             /* objects held */
+    int size;               /* capacity */
+    void *objs[];
+};
+
+struct depot {
+    pthread_mutex_t lock;
+    struct magazine *full;  /* magazines holding rounds */
+    struct magazine *empty; /* magazines holding none */
+    int nfull;
+    int magsize;            /* capacity of newly made magazines */
+    int contention;         /* contended lock acquisitions since last resize */
+};
+
+struct thread_cache {
+    pthread_mutex_t lock;
+    struct thread_cache *next, *prev;   /* registry of live caches */
+    struct {
+	struct magazine *loaded;
+	struct magazine *previous;
+    } mags[MAG_CLASSES];
+};
+
+static struct depot depots[MAG_CLASSES];
+static pthread_once_t mag_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;         /* runs cache_exit on thread exit */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct thread_cache *registry;
+static __thread struct thread_cache *my_cache;
+
+/* function prototypes for internal helper routines */
+static void mag_init(void);
+static void mag_pressure(void *arg);
+static struct thread_cache *get_cache(void);
+static void cache_exit(void *arg);
+static void cache_flush(struct thread_cache *tc);
+static void depot_lock(struct depot *d);
+static void depot_put(struct depot *d, struct magazine *m);
+static void mag_drain(struct magazine *m);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+
+/*
+ * mm_mag_malloc - Allocate size bytes, from magazines when small
+ */
+void *mm_mag_malloc(size_t size)
+{
+    struct thread_cache *tc;
+    struct magazine *m;
+    struct depot *d;
+    void *p = NULL;
+    int c;
+
+    if (size == 0 || size > MAG_MAXSIZE || (tc = get_cache()) == NULL)
+	return heap_malloc(size);
+
+    c = CLASS(size);
+    pthread_mutex_lock(&tc->lock);
+    m = tc->mags[c].loaded;
+    if (m && m->rounds) {
+	p = m->objs[--m->rounds];
+    }
+    else if (tc->mags[c].previous && tc->mags[c].previous->rounds) {
+	tc->mags[c].loaded = tc->mags[c].previous;
+	tc->mags[c].previous = m;
+	m = tc->mags[c].loaded;
+	p = m->objs[--m->rounds];
+    }
+    else {
+	d = &depots[c];
+	depot_lock(d);
+	if ((m = d->full) != NULL) {
+	    d->full = m->next;
+	    d->nfull--;
+	    if (tc->mags[c].previous)
+		depot_put(d, tc->mags[c].previous);
+	    tc->mags[c].previous = tc->mags[c].loaded;
+	    tc->mags[c].loaded = m;
+	    p = m->objs[--m->rounds];
+	}
+	pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&tc->lock);
+
+    return p ? p : heap_malloc(CLASS_SIZE(c));
+}
+
+/*
+ * mm_mag_free - Free ptr of size bytes, into magazines when small
+ */
+void mm_mag_free(void *ptr, size_t size)
+{
+    struct thread_cache *tc;
+    struct magazine *m;
+    struct depot *d;
+    int c;
+
+    if (ptr == NULL)
+	return;
+    if (size == 0 || size > MAG_MAXSIZE || (tc = get_cache()) == NULL) {
+	heap_free(ptr);
+	return;
+    }
+
+    c = CLASS(size);
+    pthread_mutex_lock(&tc->lock);
+    m = tc->mags[c].loaded;
+    if (m && m->rounds < m->size) {
+	m->objs[m->rounds++] = ptr;
+	ptr = NULL;
+    }
+    else if (tc->mags[c].previous && tc->mags[c].previous->rounds == 0) {
+	tc->mags[c].loaded = tc->mags[c].previous;
+	tc->mags[c].previous = m;
+	m = tc->mags[c].loaded;
+	m->objs[m->rounds++] = ptr;
+	ptr = NULL;
+    }
+    else {
+	d = &depots[c];
+	depot_lock(d);
+	while ((m = d->empty) != NULL && m->size < d->magsize) {
+	    d->empty = m->next;         /* put there before a resize */
+	    free(m);
+	}
+	if (m != NULL)
+	    d->empty = m->next;
+	else if ((m = malloc(offsetof(struct magazine, objs)
+			     + d->magsize * sizeof(void *))) != NULL) {
+	    m->size = d->magsize;
+	    m->rounds = 0;
+	}
+	if (m) {
+	    if (tc->mags[c].previous)
+		depot_put(d, tc->mags[c].previous);
+	    tc->mags[c].previous = tc->mags[c].loaded;
+	    tc->mags[c].loaded = m;
+	    m->objs[m->rounds++] = ptr;
+	    ptr = NULL;
+	}
+	pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&tc->lock);
+
+    if (ptr)
+	heap_free(ptr);
+}
+
+/*
+ * mm_mag_reap - Flush all thread caches, then empty the depot
+ */
+void mm_mag_reap(void)
+{
+    struct thread_cache *tc;
+    struct magazine *m, *full, *empty;
+    int c;
+
+    pthread_once(&mag_once, mag_init);
+
+    pthread_mutex_lock(&registry_lock);
+    for (tc = registry; tc; tc = tc->next)
+	cache_flush(tc);
+    pthread_mutex_unlock(&registry_lock);
+
+    for (c = 0; c < MAG_CLASSES; c++) {
+	struct depot *d = &depots[c];
+
+	pthread_mutex_lock(&d->lock);
+	full = d->full;
+	empty = d->empty;
+	d->full = d->empty = NULL;
+	d->nfull = 0;
+	pthread_mutex_unlock(&d->lock);
+
+	while ((m = full) != NULL) {
+	    full = m->next;
+	    mag_drain(m);
+	    free(m);
+	}
+	while ((m = empty) != NULL) {
+	    empty = m->next;
+	    free(m);
+	}
+    }
+}
+
+static void mag_init(void)
+{
+    int c;
+
+    for (c = 0; c < MAG_CLASSES; c++) {
+	pthread_mutex_init(&depots[c].lock, NULL);
+	depots[c].magsize = MAG_MIN;
+    }
+    pthread_key_create(&cache_key, cache_exit);
+    mm_lock();
+    mm_on_pressure(mag_pressure, NULL);
+    mm_unlock();
+}
+
+static void mag_pressure(void *arg)
+{
+    mm_mag_reap();
+}
+
+/*
+ * get_cache - This thread's cache, made and registered on first use
+ */
+static struct thread_cache *get_cache(void)
+{
+    struct thread_cache *tc = my_cache;
+
+    if (tc)
+	return tc;
+
+    pthread_once(&mag_once, mag_init);
+    if ((tc = calloc(1, sizeof(*tc))) == NULL)
+	return NULL;
+    pthread_mutex_init(&tc->lock, NULL);
+
+    pthread_mutex_lock(&registry_lock);
+    tc->next = registry;
+    if (registry)
+	registry->prev = tc;
+    registry = tc;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_setspecific(cache_key, tc);
+    my_cache = tc;
+    return tc;
+}
+
+/*
+ * cache_exit - Thread exit: give this thread's magazines to the depot
+ */
+static void cache_exit(void *arg)
+{
+    struct thread_cache *tc = arg;
+
+    pthread_mutex_lock(&registry_lock);
+    cache_flush(tc);
+    if (tc->prev)
+	tc->prev->next = tc->next;
+    else
+	registry = tc->next;
+    if (tc->next)
+	tc->next->prev = tc->prev;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_destroy(&tc->lock);
+    free(tc);
+    my_cache = NULL;
+}
+
+/*
+ * cache_flush - Move both magazines of every class to the depot
+ */
+static void cache_flush(struct thread_cache *tc)
+{
+    int c;
+
+    pthread_mutex_lock(&tc->lock);
+    for (c = 0; c < MAG_CLASSES; c++) {
+	struct depot *d = &depots[c];
+
+	pthread_mutex_lock(&d->lock);
+	if (tc->mags[c].loaded)
+	    depot_put(d, tc->mags[c].loaded);
+	if (tc->mags[c].previous)
+	    depot_put(d, tc->mags[c].previous);
+	tc->mags[c].loaded = tc->mags[c].previous = NULL;
+	pthread_mutex_unlock(&d->lock);
+    }
+    pthread_mutex_unlock(&tc->lock);
+}
+
+/*
+ * depot_lock - Take a depot lock, growing magazines if it is contended
+ */
+static void depot_lock(struct depot *d)
+{
+    if (pthread_mutex_trylock(&d->lock) == 0)
+	return;
+    pthread_mutex_lock(&d->lock);
+    if (++d->contention >= MAG_CONTENDED && d->magsize < MAG_MAX) {
+	d->magsize *= 2;
+	d->contention = 0;
+    }
+}
+
+/*
+ * depot_put - Hand magazine m to depot d (locked); past the depot's
+ *             bound its rounds go back to mm.c instead, and an empty
+ *             magazine smaller than the depot now makes is freed
+ */
+static void depot_put(struct depot *d, struct magazine *m)
+{
+    if (m->rounds && d->nfull < MAG_DEPOT_FULL) {
+	m->next = d->full;
+	d->full = m;
+	d->nfull++;
+	return;
+    }
+    mag_drain(m);
+    if (m->size < d->magsize) {
+	free(m);
+	return;
+    }
+    m->next = d->empty;
+    d->empty = m;
+}
+
+/*
+ * mag_drain - Free every round of m to mm.c
+ */
+static void mag_drain(struct magazine *m)
+{
+    if (m->rounds == 0)
+	return;
+    mm_lock();
+    while (m->rounds)
+	mm_free(m->objs[--m->rounds]);
+    mm_unlock();
+}
+
+static void *heap_malloc(size_t size)
+{
+    void *p;
+
+    mm_lock();
+    p = mm_malloc(size);
+    if (mm_unlock() && p == NULL) {
+	/* the hard limit failed it before relief could run */
+	mm_lock();
+	p = mm_malloc(size);
+	mm_unlock();
+    }
+    return p;
+}
+
+static void heap_free(void *ptr)
+{
+    mm_lock();
+    mm_free(ptr);
+    mm_unlock();
+}
@@ -0,0 +1,18 @@
+#ifndef MM_MAG_H
+#define MM_MAG_H
+
+/*
+ * mm_mag.h - magazine and depot caching of small objects over mm.c
+ *            (see mm_mag.c)
+ */
+
+#include <stddef.h>
+
+/* size must be the size passed to mm_mag_malloc, as with kmem_free */
+void *mm_mag_malloc(size_t size);
+void mm_mag_free(void *ptr, size_t size);
+
+/* flush every thread's magazines and return all cached objects to mm.c */
+void mm_mag_reap(void);
+
+#endif
@@ -0,0 +1,194 @@
+/*
+ * mm_numa.c - NUMA-local arenas
+ *
+ * One arena per online node. Each arena is a mm_shm.c region (a memfd
+ * mapping formatted as a boundary-tag heap with its own lock), bound to
+ * its node with mbind. MPOL_MF_MOVE migrates the few pages that
+ * formatting already touched, and later pages are placed on the node when
+ * first touched. mm_numa_malloc serves a thread from the arena of the node
+ * it is running on, found with getcpu and rechecked every NODE_RECHECK
+ * mallocs in case the scheduler moved the thread.
+ *
+ * REMOTE FREES
+ * A free from a thread on another node does not take the owning arena's
+ * lock (its cache line lives on the owner's node). Instead the object is
+ * pushed onto the owning arena's remote list, a lock-free stack linked
+ * through the freed objects themselves, and the owner node drains the
+ * whole list with one exchange on its next malloc. Only whole-list
+ * exchange ever pops, so the stack has no ABA problem.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "mm_shm.h"
+#include "mm_numa.h"
+
+#define MAX_NODES     64
+#define NODE_RECHECK  64    /* mallocs between getcpu calls */
+
+struct arena {
+    mm_shm_t *h;
+    char *lo, *hi;          /* mapped range, to find a pointer's arena */
+    void *remote;           /* objects freed by other nodes */
+};
+
+static struct arena arenas[MAX_NODES];
+static int nnodes;
+static __thread int my_node = -1;
+static __thread unsigned node_age;
+
+/* function prototypes for internal helper routines */
+static int online_nodes(void);
+static void drain_remote(struct arena *a);
+
+/*
+ * mm_numa_init - Make and bind one arena per online node
+ */
+int mm_numa_init(size_t arena_size)
+{
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    int n;
+
+    nnodes = online_nodes();
+    for (n = 0; n < nnodes; n++) {
+	struct arena *a = &arenas[n];
+
+	if ((a->h = mm_shm_create(NULL, arena_size)) == NULL)
+	    return -1;
+	a->lo = mm_shm_base(a->h);
+	a->hi = a->lo + mm_shm_size(a->h);
+	a->remote = NULL;
+
+	memset(mask, 0, sizeof(mask));
+	mask[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+	/* without NUMA support in the kernel, first touch still applies */
+	syscall(SYS_mbind, a->lo, a->hi - a->lo, MPOL_BIND, mask, MAX_NODES,
+		MPOL_MF_MOVE);
+    }
+    return 0;
+}
+
+int mm_numa_nodes(void)
+{
+    return nnodes;
+}
+
+/*
+ * mm_numa_current_node - Node the calling thread runs on, cached briefly
+ */
+int mm_numa_current_node(void)
+{
+    unsigned cpu, node;
+
+    if (my_node < 0 || ++node_age >= NODE_RECHECK) {
+	node_age = 0;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0 || node >= nnodes)
+	    node = 0;
+	my_node = node;
+    }
+    return my_node;
+}
+
+/*
+ * mm_numa_node_of - Arena (node) whose region holds ptr
+ */
+int mm_numa_node_of(void *ptr)
+{
+    int n;
+
+    for (n = 0; n < nnodes; n++)
+	if ((char *)ptr >= arenas[n].lo && (char *)ptr < arenas[n].hi)
+	    return n;
+    return -1;
+}
+
+void *mm_numa_malloc(size_t size)
+{
+    return mm_numa_malloc_node(size, mm_numa_current_node());
+}
+
+/*
+ * mm_numa_malloc_node - Allocate from node's arena, draining its remote
+ *                       frees first
+ */
+void *mm_numa_malloc_node(size_t size, int node)
+{
+    struct arena *a;
+
+    if (node < 0 || node >= nnodes)
+	return NULL;
+    a = &arenas[node];
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED))
+	drain_remote(a);
+    return mm_shm_malloc(a->h, size);
+}
+
+/*
+ * mm_numa_free - Free locally, or queue for the owning node
+ */
+void mm_numa_free(void *ptr)
+{
+    struct arena *a;
+    void *head;
+    int n;
+
+    if (ptr == NULL || (n = mm_numa_node_of(ptr)) < 0)
+	return;
+    a = &arenas[n];
+    if (n == mm_numa_current_node()) {
+	mm_shm_free(a->h, ptr);
+	return;
+    }
+
+    head = __atomic_load_n(&a->remote, __ATOMIC_RELAXED);
+    do {
+	*(void **)ptr = head;
+    } while (!__atomic_compare_exchange_n(&a->remote, &head, ptr, 1,
+					  __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * drain_remote - Take the whole remote list and free it into the arena
+ */
+static void drain_remote(struct arena *a)
+{
+    void *p = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+
+    while (p) {
+	void *next = *(void **)p;
+
+	mm_shm_free(a->h, p);
+	p = next;
+    }
+}
+
+/*
+ * online_nodes - Highest online node + 1, from sysfs ("0", "0-1", "0,2-3")
+ */
+static int online_nodes(void)
+{
+    char buf[256], *s;
+    int max = 0;
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+
+    if (f == NULL)
+	return 1;
+    if (fgets(buf, sizeof(buf), f)) {
+	for (s = buf; *s; s++) {
+	    if (*s >= '0' && *s <= '9') {
+		int n = strtol(s, &s, 10);
+
+		if (n > max)
+		    max = n;
+		s--;
+	    }
+	}
+    }
+    fclose(f);
+    return max + 1 > MAX_NODES ? MAX_NODES : max + 1;
+}
@@ -0,0 +1,24 @@
+#ifndef MM_NUMA_H
+#define MM_NUMA_H
+
+/*
+ * mm_numa.h - NUMA-local arenas over mm_shm.c regions (see mm_numa.c)
+ */
+
+#include <stddef.h>
+
+/* make one arena of arena_size bytes per online node; 0 on success */
+int mm_numa_init(size_t arena_size);
+
+/* allocate from the calling thread's node, or from a given node */
+void *mm_numa_malloc(size_t size);
+void *mm_numa_malloc_node(size_t size, int node);
+
+/* free to the owning arena, whichever node the caller is on */
+void mm_numa_free(void *ptr);
+
+int mm_numa_nodes(void);
+int mm_numa_node_of(void *ptr);     /* -1 if ptr is in no arena */
+int mm_numa_current_node(void);
+
+#endif
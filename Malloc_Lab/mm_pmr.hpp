@@ -0,0 +1,161 @@
+#ifndef MM_PMR_HPP
+#define MM_PMR_HPP
+
+/*
+ * mm_pmr.hpp - C++ adapters for the mm.c allocator
+ *
+ * mm::heap_resource   std::pmr::memory_resource over mm_malloc/mm_free
+ * mm::shm_resource    std::pmr::memory_resource over a mm_shm.c region
+ * mm::allocator<T>    STL allocator over mm_malloc/mm_free
+ *
+ * mm.c hands out doubleword (8 byte) aligned blocks. Requests for a
+ * stricter alignment over-allocate by the alignment and stash the
+ * original block pointer in the word just below the aligned address;
+ * deallocate is always told the alignment, so it knows to look there.
+ *
+ * mm.c itself is not thread safe, so neither are these adapters, and
+ * mem_init/mm_init must have run before the first allocation.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+extern "C" {
+#include "mm.h"
+#include "mm_shm.h"
+}
+
+namespace mm {
+
+namespace detail {
+
+constexpr std::size_t block_align = 8;  /* mm.c DSIZE */
+
+/* Allocate bytes aligned to align using raw_alloc(bytes) */
+template <class Alloc>
+inline void *aligned_alloc(Alloc raw_alloc, std::size_t bytes, std::size_t align)
+{
+    if (bytes == 0)
+	bytes = 1;
+    if (align <= block_align) {
+	void *p = raw_alloc(bytes);
+	if (!p)
+	    throw std::bad_alloc();
+	return p;
+    }
+
+    void *raw = raw_alloc(bytes + align);
+    if (!raw)
+	throw std::bad_alloc();
+    /* always move up at least one word so there is room for the stash */
+    std::uintptr_t p = (reinterpret_cast<std::uintptr_t>(raw) + align) & ~(align - 1);
+    reinterpret_cast<void **>(p)[-1] = raw;
+    return reinterpret_cast<void *>(p);
+}
+
+template <class Free>
+inline void aligned_free(Free raw_free, void *p, std::size_t align)
+{
+    if (!p)
+	return;
+    raw_free(align <= block_align ? p : static_cast<void **>(p)[-1]);
+}
+
+} // namespace detail
+
+/*
+ * heap_resource - memory resource over the process-wide mm.c heap
+ */
+class heap_resource : public std::pmr::memory_resource {
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+	return detail::aligned_alloc(mm_malloc, bytes, align);
+    }
+
+    void do_deallocate(void *p, std::size_t, std::size_t align) override
+    {
+	detail::aligned_free(mm_free, p, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+	/* there is only one mm.c heap, so any two instances are equal */
+	return dynamic_cast<const heap_resource *>(&other) != nullptr;
+    }
+};
+
+/* The shared heap_resource, analogous to std::pmr::new_delete_resource() */
+inline heap_resource *heap()
+{
+    static heap_resource r;
+    return &r;
+}
+
+/*
+ * shm_resource - memory resource over one shared memory region
+ */
+class shm_resource : public std::pmr::memory_resource {
+public:
+    explicit shm_resource(mm_shm_t *h) : h_(h) {}
+
+    mm_shm_t *handle() const { return h_; }
+
+private:
+    void *do_allocate(std::size_t bytes, std::size_t align) override
+    {
+	mm_shm_t *h = h_;
+	return detail::aligned_alloc([h](std::size_t n) { return mm_shm_malloc(h, n); },
+				     bytes, align);
+    }
+
+    void do_deallocate(void *p, std::size_t, std::size_t align) override
+    {
+	mm_shm_t *h = h_;
+	detail::aligned_free([h](void *q) { mm_shm_free(h, q); }, p, align);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+	auto *o = dynamic_cast<const shm_resource *>(&other);
+	return o && o->h_ == h_;
+    }
+
+    mm_shm_t *h_;
+};
+
+/*
+ * allocator - stateless STL allocator over the mm.c heap
+ */
+template <class T>
+struct allocator {
+    using value_type = T;
+
+    allocator() noexcept = default;
+    template <class U>
+    allocator(const allocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+	if (n > std::size_t(-1) / sizeof(T))
+	    throw std::bad_array_new_length();
+	return static_cast<T *>(detail::aligned_alloc(mm_malloc, n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *p, std::size_t) noexcept
+    {
+	detail::aligned_free(mm_free, p, alignof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const allocator<T> &, const allocator<U> &) noexcept { return true; }
+
+template <class T, class U>
+bool operator!=(const allocator<T> &, const allocator<U> &) noexcept { return false; }
+
+} // namespace mm
+
+#endif
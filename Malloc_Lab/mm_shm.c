@@ -0,0 +1,515 @@
+/*
+ * mm_shm.c - the mm.c allocator run over a shared memory region
+ *
+ * The region comes from memfd_create (anonymous, passed to children by
+ * fork or over a unix socket) or shm_open (named). Every process may map
+ * it at a different address, so nothing inside the region stores a raw
+ * pointer: blocks use the same boundary tags as mm.c, which are already
+ * relative, and the heap state in the region header is kept as offsets
+ * from the start of the region.
+ *
+ *  base                                                             end
+ *   ---------------------------------------------------------------------
+ *  | shm_hdr | pad | prologue | zero or more usr blks       | epilogue |
+ *   ---------------------------------------------------------------------
+ *
+ * The region is sized once at creation and formatted as a single free
+ * block, so there is no extend_heap. All heap updates are serialized by
+ * a process-shared robust mutex in shm_hdr. If a process dies while
+ * holding it, the next locker checks the heap, and poisons it (every
+ * malloc fails from then on) if the dead process left it torn.
+ *
+ * PER-PROCESS CACHE
+ * Each handle keeps a small process-local cache of freed small blocks,
+ * binned by exact block size. These blocks stay marked allocated in the
+ * shared heap, so mm_shm_malloc can hand them out again without taking
+ * the shared lock. Because block sizes live in the boundary tags, any
+ * process can free a block another process allocated; it simply lands
+ * in the freeing process's cache. The cache is flushed back to the
+ * shared heap on mm_shm_detach. Blocks cached by a process that dies
+ * without detaching are leaked.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include "mm_shm.h"
+
+/* Basic constants and macros, as in mm.c */
+#define WSIZE       4       /* word size (bytes) */
+#define DSIZE       8       /* doubleword size (bytes) */
+#define OVERHEAD    8       /* overhead of header and footer (bytes) */
+
+#define PACK(size, alloc)  ((size) | (alloc))
+
+#define GET(p)       (*(uint32_t *)(p))
+#define PUT(p, val)  (*(uint32_t *)(p) = (val))
+
+#define GET_SIZE(p)  (GET(p) & ~0x7)
+#define GET_ALLOC(p) (GET(p) & 0x1)
+
+#define HDRP(bp)       ((char *)(bp) - WSIZE)
+#define FTRP(bp)       ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+
+#define NEXT_BLKP(bp)  ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+#define PREV_BLKP(bp)  ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
+
+/* Convert between region offsets and this process's addresses */
+#define OFF(h, p)      ((uint64_t)((char *)(p) - (h)->base))
+#define PTR(h, off)    ((h)->base + (off))
+
+#define SHM_MAGIC     0x6d6d7368    /* "mmsh" */
+#define SHM_MAXSIZE   ((size_t)1 << 32)  /* block sizes are 32 bits */
+
+/* per-process cache: exact block sizes 16..CACHE_MAX, CACHE_DEPTH each */
+#define CACHE_MAX     256
+#define CACHE_DEPTH   16
+#define CACHE_CLASSES ((CACHE_MAX - (DSIZE + OVERHEAD)) / DSIZE + 1)
+#define CACHE_IDX(asize) (((asize) - (DSIZE + OVERHEAD)) / DSIZE)
+
+/* Shared state at the start of the region; offsets only */
+struct shm_hdr {
+    uint32_t magic;         /* SHM_MAGIC once formatted */
+    uint32_t poisoned;      /* heap torn by a dead lock owner */
+    uint64_t size;          /* bytes in the region */
+    uint64_t heap;          /* offset of first block (prologue) */
+    uint64_t rover;         /* offset of next-fit cursor */
+    uint64_t recoveries;    /* times the lock was recovered from a dead owner */
+    pthread_mutex_t lock;   /* process-shared, robust */
+};
+
+/* Process-local handle */
+struct mm_shm {
+    char *base;                 /* where this process mapped the region */
+    struct shm_hdr *hdr;
+    size_t size;
+    int fd;
+    pthread_mutex_t cache_lock; /* guards the cache between our threads */
+    uint32_t ncached[CACHE_CLASSES];
+    uint64_t cached[CACHE_CLASSES][CACHE_DEPTH];
+};
+
+#define HDR_BYTES  ((sizeof(struct shm_hdr) + DSIZE-1) & ~(size_t)(DSIZE-1))
+
+/* function prototypes for internal helper routines */
+static mm_shm_t *shm_map(int fd, size_t size);
+static void shm_format(mm_shm_t *h);
+static int shm_lock(mm_shm_t *h);
+static void shm_unlock(mm_shm_t *h);
+static void *shm_alloc_locked(mm_shm_t *h, uint32_t asize);
+static void shm_free_locked(mm_shm_t *h, void *bp);
+static void *find_fit(mm_shm_t *h, uint32_t asize);
+static void place(void *bp, uint32_t asize);
+static void *coalesce(mm_shm_t *h, void *bp);
+
+/*
+ * mm_shm_create - Create, size and format a new shared heap
+ */
+mm_shm_t *mm_shm_create(const char *name, size_t size)
+{
+    int fd;
+    mm_shm_t *h;
+
+    size = (size + DSIZE-1) & ~(size_t)(DSIZE-1);
+    if (size < HDR_BYTES + 4*WSIZE + DSIZE + OVERHEAD || size > SHM_MAXSIZE)
+	return NULL;
+
+    if (name)
+	fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    else
+	fd = memfd_create("mm_shm", 0);
+    if (fd < 0)
+	return NULL;
+    if (ftruncate(fd, size) < 0 || (h = shm_map(fd, size)) == NULL) {
+	close(fd);
+	if (name)
+	    shm_unlink(name);
+	return NULL;
+    }
+    shm_format(h);
+    return h;
+}
+
+/*
+ * mm_shm_open - Attach to a named shared heap created by another process
+ */
+mm_shm_t *mm_shm_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    mm_shm_t *h;
+
+    if (fd < 0)
+	return NULL;
+    if ((h = mm_shm_attach(fd)) == NULL)
+	close(fd);
+    return h;
+}
+
+/*
+ * mm_shm_attach - Attach to a shared heap by fd; takes ownership of fd
+ */
+mm_shm_t *mm_shm_attach(int fd)
+{
+    struct stat st;
+    mm_shm_t *h;
+
+    if (fstat(fd, &st) < 0 || (h = shm_map(fd, st.st_size)) == NULL)
+	return NULL;
+    if (__atomic_load_n(&h->hdr->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC
+	|| h->hdr->size != h->size) {
+	munmap(h->base, h->size);
+	free(h);
+	return NULL;
+    }
+    return h;
+}
+
+/*
+ * mm_shm_detach - Return cached blocks to the shared heap and unmap
+ */
+void mm_shm_detach(mm_shm_t *h)
+{
+    int i;
+    uint32_t j;
+
+    if (shm_lock(h) == 0) {
+	for (i = 0; i < CACHE_CLASSES; i++)
+	    for (j = 0; j < h->ncached[i]; j++)
+		shm_free_locked(h, PTR(h, h->cached[i][j]));
+	shm_unlock(h);
+    }
+    munmap(h->base, h->size);
+    close(h->fd);
+    pthread_mutex_destroy(&h->cache_lock);
+    free(h);
+}
+
+int mm_shm_fd(mm_shm_t *h)
+{
+    return h->fd;
+}
+
+void *mm_shm_base(mm_shm_t *h)
+{
+    return h->base;
+}
+
+size_t mm_shm_size(mm_shm_t *h)
+{
+    return h->size;
+}
+
+uint64_t mm_shm_off(mm_shm_t *h, void *p)
+{
+    return p ? OFF(h, p) : 0;
+}
+
+void *mm_shm_ptr(mm_shm_t *h, uint64_t off)
+{
+    return off ? PTR(h, off) : NULL;
+}
+
+/*
+ * mm_shm_malloc - Allocate a block with at least size bytes of payload
+ */
+void *mm_shm_malloc(mm_shm_t *h, size_t size)
+{
+    uint32_t asize;
+    char *bp = NULL;
+
+    if (size <= 0 || size > h->size)
+	return NULL;
+    /* a 4GB region could take sizes whose block size wraps 32 bits */
+    if (size > (UINT32_MAX & ~(DSIZE-1)) - OVERHEAD)
+	return NULL;
+
+    /* Adjust block size to include overhead and alignment reqs. */
+    if (size <= DSIZE)
+	asize = DSIZE + OVERHEAD;
+    else
+	asize = DSIZE * ((size + (OVERHEAD) + (DSIZE-1)) / DSIZE);
+
+    /* Try this process's cache before touching the shared lock */
+    if (asize <= CACHE_MAX) {
+	uint32_t i = CACHE_IDX(asize);
+
+	pthread_mutex_lock(&h->cache_lock);
+	if (h->ncached[i])
+	    bp = PTR(h, h->cached[i][--h->ncached[i]]);
+	pthread_mutex_unlock(&h->cache_lock);
+	if (bp)
+	    return bp;
+    }
+
+    if (shm_lock(h) != 0)
+	return NULL;
+    bp = shm_alloc_locked(h, asize);
+    shm_unlock(h);
+    return bp;
+}
+
+/*
+ * mm_shm_free - Free a block, whichever process allocated it
+ */
+void mm_shm_free(mm_shm_t *h, void *bp)
+{
+    uint32_t size;
+
+    if (bp == NULL)
+	return;
+
+    size = GET_SIZE(HDRP(bp));
+    if (size <= CACHE_MAX) {
+	uint32_t i = CACHE_IDX(size);
+	int cached = 0;
+
+	pthread_mutex_lock(&h->cache_lock);
+	if (h->ncached[i] < CACHE_DEPTH) {
+	    h->cached[i][h->ncached[i]++] = OFF(h, bp);
+	    cached = 1;
+	}
+	pthread_mutex_unlock(&h->cache_lock);
+	if (cached)
+	    return;
+    }
+
+    if (shm_lock(h) != 0)
+	return;
+    shm_free_locked(h, bp);
+    shm_unlock(h);
+}
+
+/*
+ * mm_shm_checkheap - Walk the shared heap checking every block
+ */
+int mm_shm_checkheap(mm_shm_t *h, int verbose)
+{
+    char *bp = PTR(h, h->hdr->heap);
+    char *end = h->base + h->size;
+    int errors = 0;
+
+    if (GET_SIZE(HDRP(bp)) != DSIZE || !GET_ALLOC(HDRP(bp))) {
+	printf("Bad prologue header\n");
+	return 1;
+    }
+    for (bp = NEXT_BLKP(bp); bp < end && GET_SIZE(HDRP(bp)) > 0;
+	 bp = NEXT_BLKP(bp)) {
+	if (verbose)
+	    printf("%#lx: [%u:%c]\n", (unsigned long)OFF(h, bp),
+		   GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)) ? 'a' : 'f');
+	if (OFF(h, bp) % DSIZE || FTRP(bp) >= end
+	    || GET(HDRP(bp)) != GET(FTRP(bp))) {
+	    printf("Error: bad block at offset %#lx\n", (unsigned long)OFF(h, bp));
+	    return errors + 1;
+	}
+	if (!GET_ALLOC(HDRP(bp)) && !GET_ALLOC(HDRP(NEXT_BLKP(bp)))) {
+	    printf("Error: uncoalesced free blocks at offset %#lx\n",
+		   (unsigned long)OFF(h, bp));
+	    errors++;
+	}
+    }
+    if (bp != end || !GET_ALLOC(HDRP(bp))) {
+	printf("Bad epilogue header\n");
+	errors++;
+    }
+    return errors;
+}
+
+uint64_t mm_shm_recoveries(mm_shm_t *h)
+{
+    return __atomic_load_n(&h->hdr->recoveries, __ATOMIC_RELAXED);
+}
+
+/*
+ * shm_map - Map fd and build a process-local handle for it
+ */
+static mm_shm_t *shm_map(int fd, size_t size)
+{
+    mm_shm_t *h;
+    void *base;
+
+    if (size < HDR_BYTES || size > SHM_MAXSIZE)
+	return NULL;
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    if ((h = calloc(1, sizeof(*h))) == NULL) {
+	munmap(base, size);
+	return NULL;
+    }
+    h->base = base;
+    h->hdr = base;
+    h->size = size;
+    h->fd = fd;
+    pthread_mutex_init(&h->cache_lock, NULL);
+    return h;
+}
+
+/*
+ * shm_format - Lay out the region as prologue, one free block, epilogue
+ */
+static void shm_format(mm_shm_t *h)
+{
+    struct shm_hdr *hdr = h->hdr;
+    pthread_mutexattr_t attr;
+    char *heap_listp = h->base + HDR_BYTES;
+    char *bp;
+    uint32_t size;
+
+    hdr->size = h->size;
+    hdr->poisoned = 0;
+    hdr->recoveries = 0;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&hdr->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    PUT(heap_listp, 0);                        /* alignment padding */
+    PUT(heap_listp+WSIZE, PACK(OVERHEAD, 1));  /* prologue header */
+    heap_listp += DSIZE;
+    PUT(heap_listp, PACK(OVERHEAD, 1));        /* prologue footer */
+
+    /* the rest of the region, less the epilogue header, is one free block */
+    bp = heap_listp + DSIZE;
+    size = (uint32_t)(h->size - OFF(h, bp));
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));     /* epilogue header */
+
+    hdr->heap = OFF(h, heap_listp);
+    hdr->rover = OFF(h, bp);
+    __atomic_store_n(&hdr->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * shm_lock - Take the shared lock, recovering it from a dead owner
+ */
+static int shm_lock(mm_shm_t *h)
+{
+    int rc = pthread_mutex_lock(&h->hdr->lock);
+
+    if (rc == EOWNERDEAD) {
+	/* the owner died mid-operation; only trust the heap if it checks out */
+	pthread_mutex_consistent(&h->hdr->lock);
+	h->hdr->recoveries++;
+	if (mm_shm_checkheap(h, 0))
+	    h->hdr->poisoned = 1;
+	rc = 0;
+    }
+    if (rc == 0 && h->hdr->poisoned) {
+	pthread_mutex_unlock(&h->hdr->lock);
+	return -1;
+    }
+    return rc;
+}
+
+static void shm_unlock(mm_shm_t *h)
+{
+    pthread_mutex_unlock(&h->hdr->lock);
+}
+
+static void *shm_alloc_locked(mm_shm_t *h, uint32_t asize)
+{
+    char *bp;
+
+    if ((bp = find_fit(h, asize)) == NULL)
+	return NULL;
+    place(bp, asize);
+    h->hdr->rover = OFF(h, NEXT_BLKP(bp));
+    return bp;
+}
+
+static void shm_free_locked(mm_shm_t *h, void *bp)
+{
+    uint32_t size = GET_SIZE(HDRP(bp));
+
+    PUT(HDRP(bp), PACK(size, 0));
+    PUT(FTRP(bp), PACK(size, 0));
+    coalesce(h, bp);
+}
+
+/*
+ * find_fit - Next fit from the shared rover, wrapping once since the
+ *            region cannot grow
+ */
+static void *find_fit(mm_shm_t *h, uint32_t asize)
+{
+    char *start = PTR(h, h->hdr->rover);
+    char *bp;
+
+    for (bp = start; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+	if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp)))
+	    return bp;
+
+    for (bp = NEXT_BLKP(PTR(h, h->hdr->heap)); bp < start; bp = NEXT_BLKP(bp))
+	if (!GET_ALLOC(HDRP(bp)) && asize <= GET_SIZE(HDRP(bp)))
+	    return bp;
+
+    return NULL;
+}
+
+/*
+ * place - Place block of asize bytes at start of free block bp
+ *         and split if remainder would be at least minimum block size
+ */
+static void place(void *bp, uint32_t asize)
+{
+    uint32_t csize = GET_SIZE(HDRP(bp));
+
+    if ((csize - asize) >= (DSIZE + OVERHEAD)) {
+	PUT(HDRP(bp), PACK(asize, 1));
+	PUT(FTRP(bp), PACK(asize, 1));
+	bp = NEXT_BLKP(bp);
+	PUT(HDRP(bp), PACK(csize-asize, 0));
+	PUT(FTRP(bp), PACK(csize-asize, 0));
+    }
+    else {
+	PUT(HDRP(bp), PACK(csize, 1));
+	PUT(FTRP(bp), PACK(csize, 1));
+    }
+}
+
+/*
+ * coalesce - boundary tag coalescing. Return ptr to coalesced block
+ */
+static void *coalesce(mm_shm_t *h, void *bp)
+{
+    uint32_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp)));
+    uint32_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    uint32_t size = GET_SIZE(HDRP(bp));
+
+    if (prev_alloc && next_alloc) {            /* Case 1 */
+	return bp;
+    }
+    else if (prev_alloc && !next_alloc) {      /* Case 2 */
+	size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+	PUT(HDRP(bp), PACK(size, 0));
+	PUT(FTRP(bp), PACK(size, 0));
+    }
+    else if (!prev_alloc && next_alloc) {      /* Case 3 */
+	size += GET_SIZE(HDRP(PREV_BLKP(bp)));
+	PUT(FTRP(bp), PACK(size, 0));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+	bp = PREV_BLKP(bp);
+    }
+    else {                                     /* Case 4 */
+	size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
+	    GET_SIZE(FTRP(NEXT_BLKP(bp)));
+	PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
+	PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+	bp = PREV_BLKP(bp);
+    }
+
+    /* the rover may have pointed into an absorbed block */
+    h->hdr->rover = OFF(h, bp);
+    return bp;
+}
@@ -0,0 +1,44 @@
+#ifndef MM_SHM_H
+#define MM_SHM_H
+
+/*
+ * mm_shm.h - allocator over a shared memory region mapped by several
+ *            processes (see mm_shm.c)
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct mm_shm mm_shm_t;  /* per-process handle on a shared heap */
+
+/* create a new shared heap of size bytes; name NULL means anonymous memfd */
+mm_shm_t *mm_shm_create(const char *name, size_t size);
+
+/* attach to an existing shared heap by shm_open name or by inherited fd */
+mm_shm_t *mm_shm_open(const char *name);
+mm_shm_t *mm_shm_attach(int fd);
+
+/* flush this process's cache and unmap the region */
+void mm_shm_detach(mm_shm_t *h);
+
+/* fd backing the region, to hand to other processes (fork, SCM_RIGHTS) */
+int mm_shm_fd(mm_shm_t *h);
+
+/* where this process mapped the region, and its size */
+void *mm_shm_base(mm_shm_t *h);
+size_t mm_shm_size(mm_shm_t *h);
+
+void *mm_shm_malloc(mm_shm_t *h, size_t size);
+void mm_shm_free(mm_shm_t *h, void *bp);
+
+/* position-independent references for storing inside the region */
+uint64_t mm_shm_off(mm_shm_t *h, void *p);
+void *mm_shm_ptr(mm_shm_t *h, uint64_t off);
+
+/* check the shared heap for consistency, returns number of errors */
+int mm_shm_checkheap(mm_shm_t *h, int verbose);
+
+/* times the lock was taken back from a process that died holding it */
+uint64_t mm_shm_recoveries(mm_shm_t *h);
+
+#endif
@@ -0,0 +1,230 @@
+/*
+ * mm_tlab.c - thread-local allocation buffers for the smallest objects
+ *
+ * Objects up to TLAB_MAXSIZE bytes are bumped out of a buffer the thread
+ * owns: a TLAB_SIZE block of mm.c heap, aligned to TLAB_SIZE, with a
+ * header on its first cache line. A malloc is a compare and an add on
+ * two thread-local pointers, with no lock, atomic or shared write. Freed
+ * objects are not reused one by one; a buffer goes back to mm.c as a
+ * whole once every object in it has been freed.
+ *
+ * LIVE COUNT
+ * The owner counts its allocations privately; frees, from any thread,
+ * decrement the buffer's shared live count, which starts at TLAB_BIAS.
+ * TLAB_BIAS exceeds the objects a buffer can hold, so the count cannot
+ * reach zero while the owner is still allocating. When the buffer is
+ * full the owner retires it by subtracting TLAB_BIAS less its
+ * allocations, which leaves exactly the objects still live, and whoever
+ * takes the count to zero, the owner or the last free, returns the
+ * buffer to mm.c. If every object was already freed when the buffer
+ * fills, the owner just rewinds it and keeps going.
+ *
+ * Because buffers are aligned, the header of an object's buffer is its
+ * address rounded down. mm_tlab_free tells buffer objects from ordinary
+ * mm.c blocks by a bitmap with one bit per TLAB_SIZE unit of the heap,
+ * set while a buffer occupies that unit. No ordinary block can start in
+ * such a unit, and the bit cannot change while the object being freed is
+ * live, so the bitmap is read without a lock; it is written under
+ * mm_lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+#include "mm_tlab.h"
+
+#define TLAB_SHIFT    15                    /* log2 of buffer size */
+#define TLAB_SIZE     (1 << TLAB_SHIFT)
+#define TLAB_HDR      64                    /* header, alone on its line */
+#define TLAB_STEP     8                     /* object size granularity */
+#define TLAB_MAXSIZE  64                    /* largest size bumped */
+#define TLAB_BIAS     (1L << 30)            /* > objects per buffer */
+#define TLAB_UNITS    (1L << (32 - TLAB_SHIFT))  /* in a 4GB heap */
+
+/* Index of the TLAB_SIZE unit of the heap that p lies in */
+#define UNIT(p)   (((uintptr_t)(p) >> TLAB_SHIFT) - \
+		   ((uintptr_t)mem_heap_lo() >> TLAB_SHIFT))
+
+/* The buffer holding object p */
+#define TLAB_OF(p) ((struct tlab *)((uintptr_t)(p) & ~(uintptr_t)(TLAB_SIZE-1)))
+
+struct tlab {
+    long live;      /* TLAB_BIAS less frees; after retiring, live objects */
+};
+
+static uint64_t tlab_map[TLAB_UNITS / 64];  /* bit set iff unit is a buffer */
+static pthread_once_t tlab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t tlab_key;              /* retires the buffer on exit */
+
+/* this thread's buffer */
+static __thread struct tlab *my_tlab;
+static __thread char *bump, *bump_end;
+static __thread long my_allocs;             /* objects bumped from it */
+
+/* function prototypes for internal helper routines */
+static void tlab_init(void);
+static void tlab_exit(void *arg);
+static void *refill(size_t size);
+static void retire(struct tlab *t, long allocs);
+static void reclaim(struct tlab *t);
+static int is_tlab(void *ptr);
+static void *heap_malloc(size_t size);
+static void heap_free(void *ptr);
+
+/*
+ * mm_tlab_malloc - Allocate size bytes, bumped from this thread's buffer
+ *                  when small
+ */
+void *mm_tlab_malloc(size_t size)
+{
+    char *p = bump;
+
+    if (size == 0 || size > TLAB_MAXSIZE)
+	return heap_malloc(size);
+    size = (size + TLAB_STEP-1) & ~(size_t)(TLAB_STEP-1);
+    if (p + size > bump_end)
+	return refill(size);
+    bump = p + size;
+    my_allocs++;
+    return p;
+}
+
+/*
+ * mm_tlab_free - Free ptr, from a buffer or from mm.c
+ */
+void mm_tlab_free(void *ptr)
+{
+    struct tlab *t;
+
+    if (ptr == NULL)
+	return;
+    if (!is_tlab(ptr)) {
+	heap_free(ptr);
+	return;
+    }
+    t = TLAB_OF(ptr);
+    if (__atomic_sub_fetch(&t->live, 1, __ATOMIC_ACQ_REL) == 0)
+	reclaim(t);
+}
+
+/*
+ * mm_tlab_retire - Stop bumping from this thread's buffer
+ */
+void mm_tlab_retire(void)
+{
+    if (my_tlab == NULL)
+	return;
+    retire(my_tlab, my_allocs);
+    my_tlab = NULL;
+    bump = bump_end = NULL;
+    pthread_setspecific(tlab_key, NULL);
+}
+
+static void tlab_init(void)
+{
+    pthread_key_create(&tlab_key, tlab_exit);
+}
+
+/*
+ * tlab_exit - Thread exit: retire the thread's buffer
+ */
+static void tlab_exit(void *arg)
+{
+    retire(arg, my_allocs);
+    my_tlab = NULL;
+}
+
+/*
+ * refill - The buffer is full: rewind it if all its objects are free,
+ *          else retire it and start a new one; then bump size bytes
+ */
+static void *refill(size_t size)
+{
+    struct tlab *t = my_tlab;
+    char *p;
+
+    if (t && __atomic_load_n(&t->live, __ATOMIC_ACQUIRE) == TLAB_BIAS - my_allocs) {
+	/* no object of it is live, so no free can race with the rewind */
+	t->live = TLAB_BIAS;
+    }
+    else {
+	pthread_once(&tlab_once, tlab_init);
+	if (t)
+	    retire(t, my_allocs);
+	mm_lock();
+	if ((t = mm_memalign(TLAB_SIZE, TLAB_SIZE)) != NULL)
+	    __atomic_fetch_or(&tlab_map[UNIT(t) / 64],
+			      (uint64_t)1 << (UNIT(t) % 64), __ATOMIC_RELAXED);
+	mm_unlock();
+	my_tlab = t;
+	pthread_setspecific(tlab_key, t);
+	if (t == NULL) {
+	    bump = bump_end = NULL;
+	    return heap_malloc(size);
+	}
+	t->live = TLAB_BIAS;
+    }
+    my_allocs = 1;
+    p = (char *)t + TLAB_HDR;
+    bump = p + size;
+    bump_end = (char *)t + TLAB_SIZE;
+    return p;
+}
+
+/*
+ * retire - The owner is done with t after allocs objects; reclaim it
+ *          now if they are all freed already
+ */
+static void retire(struct tlab *t, long allocs)
+{
+    if (__atomic_sub_fetch(&t->live, TLAB_BIAS - allocs, __ATOMIC_ACQ_REL) == 0)
+	reclaim(t);
+}
+
+/*
+ * reclaim - Return the buffer t, every object of it freed, to mm.c
+ */
+static void reclaim(struct tlab *t)
+{
+    mm_lock();
+    __atomic_fetch_and(&tlab_map[UNIT(t) / 64],
+		       ~((uint64_t)1 << (UNIT(t) % 64)), __ATOMIC_RELAXED);
+    mm_free(t);
+    mm_unlock();
+}
+
+/*
+ * is_tlab - Whether ptr lies in a buffer
+ */
+static int is_tlab(void *ptr)
+{
+    uintptr_t u = UNIT(ptr);
+
+    return (__atomic_load_n(&tlab_map[u / 64], __ATOMIC_RELAXED) >> (u % 64)) & 1;
+}
+
+static void *heap_malloc(size_t size)
+{
+    void *p;
+
+    mm_lock();
+    p = mm_malloc(size);
+    if (mm_unlock() && p == NULL) {
+	/* the hard limit failed it before relief could run */
+	mm_lock();
+	p = mm_malloc(size);
+	mm_unlock();
+    }
+    return p;
+}
+
+static void heap_free(void *ptr)
+{
+    mm_lock();
+    mm_free(ptr);
+    mm_unlock();
+}
@@ -0,0 +1,22 @@
+#ifndef MM_TLAB_H
+#define MM_TLAB_H
+
+/*
+ * mm_tlab.h - thread-local bump allocation of the smallest objects over
+ *             mm.c (see mm_tlab.c)
+ */
+
+#include <stddef.h>
+
+/* any pointer from mm.c may be passed to mm_tlab_free; objects from
+   mm_tlab_malloc must not go to mm_free or mm_realloc */
+void *mm_tlab_malloc(size_t size);
+void mm_tlab_free(void *ptr);
+
+/* give up this thread's buffer, as thread exit does, so it can be
+   reclaimed once its objects are freed. Every thread still holding a
+   buffer must do this, and every buffer object must be freed, before
+   mm_init starts a new heap */
+void mm_tlab_retire(void);
+
+#endif
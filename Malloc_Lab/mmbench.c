@@ -0,0 +1,928 @@
+/*
+ * mmbench.c - replay malloc lab traces against mm.c, one line per trace
+ *
+ * For each trace it reports throughput, utilization (peak live payload
+ * over final heap size, as mdriver computes it), how many times and by
+ * how much the heap grew, the page faults taken during the replay, the
+ * dTLB miss rate (perf counters, -1 if unavailable), and how much of the
+ * heap's resident memory is transparent huge pages according to
+ * /proc/self/smaps.
+ *
+ * usage: mmbench [-g] [-p] [-m] [-H] [-L] [-P] [-k K] [-V budget]
+ *                [-v period] [-G pct] [-M prefix] [-T] trace.rep ...
+ *        mmbench -F size
+ *        mmbench -R soft_kb
+ *        mmbench -C
+ *        mmbench -S strings
+ *   -g   grow by fixed CHUNKSIZE (MM_FIXED_CHUNK) instead of adaptively
+ *   -p   prefault new heap chunks (MM_PREFAULT)
+ *   -m   serve small objects from page-mapped spans (MM_PAGEMAP)
+ *   -H   huge page aware heap layout (MM_HUGEPAGE)
+ *   -L   pass each malloc the lifetime class its block will turn out to
+ *        have in the trace (mm_malloc_hint), an oracle for what
+ *        MM_LIFETIME tries to predict
+ *   -P   replay every trace under every placement policy and print
+ *        throughput against utilization instead
+ *   -k   candidates searched by the good fit policy
+ *   -V   run the incremental verifier, checking budget blocks per check,
+ *        and report any problems it finds
+ *   -v   calls per verifier check (default the allocator's VERIFY_PERIOD)
+ *   -G   leak pct% of the trace's frees (drop the pointer instead) and let
+ *        the collector (MM_GC) find them; reports collections, bytes
+ *        collected and pause times
+ *   -M   analyze the heap (mm_heap_analyze) when the trace's live bytes
+ *        peak, report its fragmentation and write its map to
+ *        prefix<trace>.map for mmheapmap; not counted in the throughput
+ *   -T   record malloc latency and find_fit visits per size class
+ *        (MM_LATENCY) and print the histograms after each trace; with
+ *        -P, print the 99.9th percentile latency and the most blocks one
+ *        malloc visited, over all classes, under each policy instead
+ *   -F   instead of traces, free FREE_OBJS cold objects of size bytes in
+ *        random order with and without MM_PAGEMAP, and report the L1D
+ *        and last-level cache misses per free
+ *   -R   instead of traces, fill an application cache that sheds entries
+ *        only when mm.c calls its pressure callback, with no heap limit
+ *        and then with a soft limit of soft_kb (hard limit 5/4 of that),
+ *        and report how the heap size and its RSS track the limit. Then
+ *        fill mm_lf's pools up to the hard limit and check that a malloc
+ *        of soft_kb/2 through mm_lf still succeeds, as the pools' pressure
+ *        callback makes room; exits 1 if it fails
+ *   -C   instead of traces, time the fast path in cycles per call: a
+ *        malloc and free of one size that never grow the heap, under
+ *        next fit and first fit, and a realloc that stays in its block
+ *        (build with -DMM_CLASS_ARITH to compare the size class tables)
+ *   -S   instead of traces, build strings of STRING_BYTES bytes each by
+ *        appending 1 to 16 byte pieces with mm_realloc, strings at a
+ *        time interleaved, with and without MM_REALLOC_GROW, and report
+ *        how many reallocs moved their block and how many bytes they
+ *        copied
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+#include "mm_lf.h"
+
+/* One trace operation, as in mdriver's .rep files */
+struct op {
+    char type;      /* 'a'lloc, 'f'ree or 'r'ealloc */
+    int id;         /* block id */
+    size_t size;    /* payload bytes for 'a' and 'r' */
+    int life;       /* MM_LIFE_* the block turns out to have, for 'a' */
+};
+
+struct trace {
+    const char *name;
+    int num_ids;
+    int num_ops;
+    struct op *ops;
+};
+
+/* Result of one replay */
+struct result {
+    double secs;
+    double util;
+    long faults;
+    long verify_errors; /* found by the incremental verifier */
+    double dtlb_miss;   /* dTLB misses per dTLB access, -1 if unknown */
+    double thp;         /* AnonHugePages / Rss of the heap mapping */
+    struct mm_stats st;
+    struct mm_heap_report heap; /* at peak live bytes, with -M */
+    unsigned long tail_cycles;  /* 99.9th percentile malloc, with -T */
+    unsigned long max_visits;   /* most blocks a find_fit visited, -T */
+};
+
+#define FREE_OBJS   100000      /* objects freed by -F */
+#define EVICT_BYTES (32 << 20)  /* written between malloc and free by -F */
+#define SHORT_OPS   1000        /* ops a short-lived block lives under */
+#define CACHE_SLOTS 8192        /* entries in the -R application cache */
+#define CACHE_OPS   400000      /* inserts made by -R */
+#define CACHE_ROWS  10          /* progress lines per -R run */
+#define POOL_OBJ    64          /* size -R pools in mm_lf to the hard limit */
+#define CLASS_CALLS 1000000     /* calls timed per size by -C */
+#define STRING_BYTES 16384      /* length of each -S string */
+
+static int heap_flags;
+static int lifetime_hints;
+static int verify_budget, verify_period;
+static int gc_leak;             /* percent of frees -G drops */
+static const char *map_prefix;  /* -M */
+static int fit_policy = MM_NEXT_FIT, fit_k;
+
+static const struct {
+    const char *name;
+    int policy;
+} policies[] = {
+    { "first", MM_FIRST_FIT },
+    { "next", MM_NEXT_FIT },
+    { "best", MM_BEST_FIT },
+    { "good", MM_GOOD_FIT },
+    { "aoff", MM_AOFF },
+};
+static int dtlb_access_fd = -1, dtlb_miss_fd = -1;
+
+/*
+ * read_trace - Parse a .rep file; exits on malformed input
+ */
+static struct trace *read_trace(const char *path)
+{
+    struct trace *t = calloc(1, sizeof(*t));
+    int sugg_heapsize, weight, i;
+    char type[2];
+    FILE *f;
+
+    if (t == NULL || (f = fopen(path, "r")) == NULL) {
+	perror(path);
+	exit(1);
+    }
+    t->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    if (fscanf(f, "%d %d %d %d", &sugg_heapsize, &t->num_ids, &t->num_ops,
+	       &weight) != 4 || t->num_ids <= 0 || t->num_ops <= 0) {
+	fprintf(stderr, "%s: bad trace header\n", path);
+	exit(1);
+    }
+    t->ops = calloc(t->num_ops, sizeof(struct op));
+    for (i = 0; i < t->num_ops; i++) {
+	struct op *op = &t->ops[i];
+
+	if (fscanf(f, "%1s %d", type, &op->id) != 2
+	    || (type[0] != 'f' && fscanf(f, "%zu", &op->size) != 1)
+	    || !strchr("afr", type[0]) || op->id < 0 || op->id >= t->num_ids) {
+	    fprintf(stderr, "%s: bad op %d\n", path, i);
+	    exit(1);
+	}
+	op->type = type[0];
+    }
+    fclose(f);
+
+    /* each block's lifetime, from its alloc to its free (or the end) */
+    {
+	int *born = malloc(t->num_ids * sizeof(int));
+
+	for (i = 0; i < t->num_ops; i++) {
+	    struct op *op = &t->ops[i];
+
+	    if (op->type == 'a') {
+		born[op->id] = i;
+		op->life = MM_LIFE_LONG;
+	    }
+	    else if (op->type == 'f' && i - born[op->id] < SHORT_OPS)
+		t->ops[born[op->id]].life = MM_LIFE_SHORT;
+	}
+	free(born);
+    }
+    return t;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * ticks - The time stamp counter where there is one, else nanoseconds
+ */
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#else
+    return now() * 1e9;
+#endif
+}
+
+static long faults(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_minflt + ru.ru_majflt;
+}
+
+/*
+ * perf_open - Open a disabled counter for this thread, -1 if unavailable
+ */
+static int perf_open(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr pe;
+
+    memset(&pe, 0, sizeof(pe));
+    pe.size = sizeof(pe);
+    pe.type = type;
+    pe.config = config;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void perf_start(int fd)
+{
+    if (fd >= 0) {
+	ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+	ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+static long long perf_stop(int fd)
+{
+    long long count;
+
+    if (fd < 0)
+	return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count))
+	return -1;
+    return count;
+}
+
+/*
+ * free_bench - Cache misses per mm_free of cold objects
+ */
+static void free_bench(size_t size)
+{
+    static const char *modes[] = { "boundary tags", "page map" };
+    int l1 = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+		       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		       (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    int llc = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+    void **objs = malloc(FREE_OBJS * sizeof(void *));
+    char *evict = malloc(EVICT_BYTES);
+    long long l1_misses, llc_misses;
+    double start, secs;
+    int mode, i;
+
+    if (l1 < 0 || llc < 0)
+	printf("(perf counters unavailable, misses reported as -1)\n");
+    printf("%-14s %6s %10s %10s %10s\n", "mode", "size", "ns/free",
+	   "L1D/free", "LLC/free");
+    for (mode = 0; mode < 2; mode++) {
+	mem_deinit();
+	mem_init();
+	mm_set_flags(heap_flags | (mode ? MM_PAGEMAP : 0));
+	if (mm_init() < 0) {
+	    printf("mm_init failed\n");
+	    return;
+	}
+	for (i = 0; i < FREE_OBJS; i++)
+	    if ((objs[i] = mm_malloc(size)) == NULL) {
+		printf("%-14s out of memory\n", modes[mode]);
+		return;
+	    }
+	/* shuffle so frees do not walk memory in order */
+	srand(1);
+	for (i = FREE_OBJS - 1; i > 0; i--) {
+	    int j = rand() % (i + 1);
+	    void *tmp = objs[i];
+
+	    objs[i] = objs[j];
+	    objs[j] = tmp;
+	}
+	memset(evict, mode, EVICT_BYTES);
+
+	perf_start(l1);
+	perf_start(llc);
+	start = now();
+	for (i = 0; i < FREE_OBJS; i++)
+	    mm_free(objs[i]);
+	secs = now() - start;
+	l1_misses = perf_stop(l1);
+	llc_misses = perf_stop(llc);
+
+	printf("%-14s %6zu %10.1f %10.2f %10.2f\n", modes[mode], size,
+	       secs * 1e9 / FREE_OBJS,
+	       l1_misses < 0 ? -1.0 : (double)l1_misses / FREE_OBJS,
+	       llc_misses < 0 ? -1.0 : (double)llc_misses / FREE_OBJS);
+    }
+    free(objs);
+    free(evict);
+    if (l1 >= 0)
+	close(l1);
+    if (llc >= 0)
+	close(llc);
+}
+
+/*
+ * smaps_kb - Sum of an smaps field ("Rss:", ...) over the mappings that
+ *            overlap [lo, hi), in kB, or -1 if smaps is unreadable.
+ *            madvise splits the heap's mapping, so sum them all.
+ */
+static long smaps_kb(void *lo, void *hi, const char *field)
+{
+    char line[256];
+    unsigned long start, end, kb;
+    size_t len = strlen(field);
+    long sum = 0;
+    int in = 0;
+    FILE *f = fopen("/proc/self/smaps", "r");
+
+    if (f == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), f)) {
+	if (sscanf(line, "%lx-%lx ", &start, &end) == 2)   /* mapping header */
+	    in = start < (unsigned long)hi && (unsigned long)lo < end;
+	else if (in && strncmp(line, field, len) == 0
+		 && sscanf(line + len, "%lu", &kb) == 1)
+	    sum += kb;
+    }
+    fclose(f);
+    return sum;
+}
+
+/*
+ * resident_kb - Resident memory of [lo, hi) alone, in kB, or -1 if
+ *               mincore fails. smaps counts whole mappings, and memlib's
+ *               one mapping runs on past the heap, over pages an earlier
+ *               heap may have left resident.
+ */
+static long resident_kb(void *lo, void *hi)
+{
+    size_t page = getpagesize(), n, i;
+    char *start = (char *)((uintptr_t)lo & ~(uintptr_t)(page - 1));
+    unsigned char *vec;
+    long pages = 0;
+
+    n = ((char *)hi - start + page - 1) / page;
+    if ((vec = malloc(n)) == NULL || mincore(start, n * page, vec) != 0) {
+	free(vec);
+	return -1;
+    }
+    for (i = 0; i < n; i++)
+	pages += vec[i] & 1;
+    free(vec);
+    return pages * (page / 1024);
+}
+
+/*
+ * class_bench - Cycles per call where malloc, free and realloc do little
+ *               more than classify the size and touch one free list
+ */
+static void class_bench(void)
+{
+    static const size_t sizes[] = { 1, 24, 100, 500, 1000, 4000 };
+    static const int fits[] = { MM_NEXT_FIT, MM_FIRST_FIT };
+    double per[2];
+    uint64_t t;
+    void *p;
+    size_t size, lo;
+    int s, f, i;
+
+    printf("%6s %16s %16s %10s\n", "size", "next fit m+f", "first fit m+f",
+	   "realloc");
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+	size = sizes[s];
+	for (f = 0; f < 2; f++) {
+	    mem_deinit();
+	    mem_init();
+	    mm_set_flags(heap_flags);
+	    mm_set_policy(fits[f], fit_k);
+	    if (mm_init() < 0) {
+		printf("mm_init failed\n");
+		return;
+	    }
+	    mm_free(mm_malloc(size));
+	    t = ticks();
+	    for (i = 0; i < CLASS_CALLS; i++) {
+		p = mm_malloc(size);
+		mm_free(p);
+	    }
+	    per[f] = (double)(ticks() - t) / CLASS_CALLS;
+	}
+
+	/* between size and the smallest size with the same block */
+	lo = size - (size - 1) % 8;
+	p = mm_malloc(size);
+	t = ticks();
+	for (i = 0; i < CLASS_CALLS; i++)
+	    p = mm_realloc(p, i & 1 ? lo : size);
+	printf("%6zu %16.1f %16.1f %10.1f\n", size, per[0], per[1],
+	       (double)(ticks() - t) / CLASS_CALLS);
+	mm_free(p);
+    }
+    mm_set_policy(fit_policy, fit_k);
+}
+
+/*
+ * string_bench - Build n strings at once by appending with mm_realloc
+ */
+static void string_bench(int n)
+{
+    static const char *modes[] = { "realloc", "realloc grow" };
+    char **str = calloc(n, sizeof(char *));
+    size_t *len = calloc(n, sizeof(size_t));
+    struct mm_stats st;
+    double start, secs;
+    long appends;
+    size_t piece;
+    int mode, i;
+
+    if (str == NULL || len == NULL) {
+	perror("string_bench");
+	exit(1);
+    }
+    printf("%-14s %8s %10s %8s %11s %10s %9s\n", "mode", "strings", "reallocs",
+	   "moves", "copied(KB)", "Kops/s", "heap(KB)");
+    for (mode = 0; mode < 2; mode++) {
+	mem_deinit();
+	mem_init();
+	mm_set_flags(heap_flags | (mode ? MM_REALLOC_GROW : 0));
+	if (mm_init() < 0) {
+	    printf("mm_init failed\n");
+	    return;
+	}
+	memset(str, 0, n * sizeof(char *));
+	memset(len, 0, n * sizeof(size_t));
+	srand(1);
+	appends = 0;
+	start = now();
+	for (;;) {
+	    i = rand() % n;
+	    if (len[i] >= STRING_BYTES) {
+		/* sweep for the last few instead of waiting on rand */
+		for (i = 0; i < n && len[i] >= STRING_BYTES; i++)
+		    ;
+		if (i == n)
+		    break;
+	    }
+	    piece = rand() % 16 + 1;
+	    str[i] = len[i] ? mm_realloc(str[i], len[i] + piece)
+			    : mm_malloc(piece);
+	    memset(str[i] + len[i], 'a' + i % 26, piece);
+	    len[i] += piece;
+	    appends++;
+	}
+	secs = now() - start;
+	mm_get_stats(&st);
+	printf("%-14s %8d %10lu %8lu %11lu %10.0f %9zu\n", modes[mode], n,
+	       st.realloc_calls, st.realloc_moves, st.realloc_copied / 1024,
+	       appends / secs / 1e3, mem_heapsize() / 1024);
+	for (i = 0; i < n; i++)
+	    mm_free(str[i]);
+    }
+    free(str);
+    free(len);
+}
+
+/*
+ * thp_coverage - Fraction of the resident memory of the heap that is
+ *                backed by transparent huge pages
+ */
+static double thp_coverage(void *lo, void *hi)
+{
+    long rss = smaps_kb(lo, hi, "Rss:");
+
+    return rss > 0 ? (double)smaps_kb(lo, hi, "AnonHugePages:") / rss : -1;
+}
+
+/* The -R application cache */
+static void *cache[CACHE_SLOTS];
+static size_t cache_size[CACHE_SLOTS];
+static size_t cache_bytes;
+static int cache_half;          /* which half the next eviction drops */
+
+/*
+ * cache_evict - Pressure callback: drop every other cache entry
+ */
+static void cache_evict(void *arg)
+{
+    int i;
+
+    for (i = cache_half; i < CACHE_SLOTS; i += 2) {
+	if (cache[i]) {
+	    mm_free(cache[i]);
+	    cache_bytes -= cache_size[i];
+	    cache[i] = NULL;
+	}
+    }
+    cache_half ^= 1;
+}
+
+/*
+ * limit_bench - Heap size and RSS of a growing cache, with and without
+ *               a soft limit of soft bytes
+ */
+static void limit_bench(size_t soft)
+{
+    static int registered;
+    struct mm_stats st;
+    long fails;
+    int run, i, slot;
+
+    if (!registered) {
+	mm_on_pressure(cache_evict, NULL);
+	registered = 1;
+    }
+    for (run = 0; run < 2; run++) {
+	size_t lim = run ? soft : 0;
+
+	printf("%s\n", run ? "soft limit" : "no limit");
+	if (lim)
+	    printf("soft %zu KB, hard %zu KB\n", lim / 1024, lim / 4 * 5 / 1024);
+	printf("%10s %10s %10s %10s %10s %9s %7s\n", "inserts", "heap(KB)",
+	       "RSS(KB)", "live(KB)", "entries", "pressure", "fails");
+
+	mem_deinit();
+	mem_init();
+	mm_set_flags(heap_flags);
+	mm_set_limits(lim, lim / 4 * 5);
+	memset(cache, 0, sizeof(cache));
+	cache_bytes = 0;
+	fails = 0;
+	if (mm_init() < 0) {
+	    printf("mm_init failed\n");
+	    break;
+	}
+	srand(1);
+	for (i = 1; i <= CACHE_OPS; i++) {
+	    size_t size = rand() % 4096 + 16;
+
+	    slot = rand() % CACHE_SLOTS;
+	    if (cache[slot]) {
+		mm_free(cache[slot]);
+		cache_bytes -= cache_size[slot];
+		cache[slot] = NULL;    /* the malloc may call cache_evict */
+	    }
+	    if ((cache[slot] = mm_malloc(size)) == NULL) {
+		fails++;
+	    }
+	    else {
+		memset(cache[slot], i, size);
+		cache_size[slot] = size;
+		cache_bytes += size;
+	    }
+
+	    if (i % (CACHE_OPS / CACHE_ROWS) == 0) {
+		int n = 0, j;
+
+		for (j = 0; j < CACHE_SLOTS; j++)
+		    n += cache[j] != NULL;
+		mm_get_stats(&st);
+		printf("%10d %10zu %10ld %10zu %10d %9lu %7ld\n", i,
+		       mem_heapsize() / 1024,
+		       resident_kb(mem_heap_lo(), (char *)mem_heap_hi() + 1),
+		       cache_bytes / 1024, n, st.pressure_runs, fails);
+	    }
+	}
+    }
+    mm_set_limits(0, 0);
+}
+
+/*
+ * layer_limit - Pool POOL_OBJ byte objects in mm_lf until the heap is at
+ *               its hard limit, then malloc soft/2 bytes through mm_lf,
+ *               which only relief (mm_lf reaping its pools) can make room
+ *               for; returns 0 if the malloc succeeded, else 1
+ */
+static int layer_limit(size_t soft)
+{
+    size_t cap = soft / 4 * 5 / POOL_OBJ + 1, n = 0, i;
+    void **objs = malloc(cap * sizeof(void *));
+    struct mm_stats st;
+    void *p = NULL;
+
+    mem_deinit();
+    mem_init();
+    mm_set_flags(heap_flags);
+    mm_set_limits(soft, soft / 4 * 5);
+    memset(cache, 0, sizeof(cache));   /* cache_evict is still registered */
+    if (objs == NULL || mm_init() < 0) {
+	printf("mm_init failed\n");
+	free(objs);
+	return 1;
+    }
+    while (n < cap && (objs[n] = mm_lf_malloc(POOL_OBJ)) != NULL)
+	n++;
+    for (i = 0; i < n; i++)
+	mm_lf_free(objs[i], POOL_OBJ);
+    p = mm_lf_malloc(soft / 2);
+    mm_get_stats(&st);
+    printf("mm_lf at the hard limit, %zu KB pooled: %zu KB malloc %s "
+	   "(pressure %lu, limit fails %lu)\n", n * POOL_OBJ / 1024,
+	   soft / 2 / 1024, p ? "ok" : "FAILED", st.pressure_runs,
+	   st.limit_fails);
+    mm_lf_free(p, soft / 2);
+    mm_lf_reap();
+    mm_set_limits(0, 0);
+    free(objs);
+    return p == NULL;
+}
+
+/*
+ * latency_tail - The 99.9th percentile malloc latency (bin upper bound)
+ *                and the longest find_fit walk, over all size classes
+ */
+static void latency_tail(struct result *r)
+{
+    struct mm_latency lat[64];
+    unsigned long bins[MM_LAT_BINS] = { 0 }, calls = 0, seen = 0;
+    int n = mm_get_latency(lat, 64), c, b;
+
+    r->max_visits = 0;
+    for (c = 0; c < n && c < 64; c++) {
+	calls += lat[c].calls;
+	for (b = 0; b < MM_LAT_BINS; b++)
+	    bins[b] += lat[c].cycles[b];
+	if (lat[c].max_visits > r->max_visits)
+	    r->max_visits = lat[c].max_visits;
+    }
+    for (b = 0; b < MM_LAT_BINS - 1; b++)
+	if ((seen += bins[b]) >= calls * 0.999)
+	    break;
+    r->tail_cycles = 2UL << b;
+}
+
+/*
+ * replay - Run a trace on a fresh heap; returns 0 on success
+ */
+static int replay(struct trace *t, struct result *r)
+{
+    void **blocks = calloc(t->num_ids, sizeof(void *));
+    size_t *sizes = calloc(t->num_ids, sizeof(size_t));
+    size_t live = 0, peak = 0;
+    long faults0;
+    long long accesses, misses;
+    double start, pause;
+    char map[4096];
+    int i, peak_op = -1, rc = 0;
+
+    if (map_prefix) {
+	/* the op after which the live bytes first peak */
+	for (i = 0; i < t->num_ops; i++) {
+	    struct op *op = &t->ops[i];
+
+	    if (op->type == 'a')
+		live += sizes[op->id] = op->size;
+	    else if (op->type == 'r') {
+		live += op->size - sizes[op->id];
+		sizes[op->id] = op->size;
+	    }
+	    else {
+		live -= sizes[op->id];
+		sizes[op->id] = 0;
+	    }
+	    if (live > peak) {
+		peak = live;
+		peak_op = i;
+	    }
+	}
+	memset(sizes, 0, t->num_ids * sizeof(size_t));
+	live = peak = 0;
+	snprintf(map, sizeof(map), "%s%s.map", map_prefix, t->name);
+    }
+    memset(&r->heap, 0, sizeof(r->heap));
+
+    /* a fresh memlib heap, so every trace starts from untouched pages */
+    mem_deinit();
+    mem_init();
+    mm_set_flags(heap_flags);
+    mm_set_policy(fit_policy, fit_k);
+    mm_set_verify(verify_budget, verify_period);
+    if (gc_leak)
+	mm_gc_add_root(blocks, t->num_ids * sizeof(void *));
+
+    faults0 = faults();
+    perf_start(dtlb_access_fd);
+    perf_start(dtlb_miss_fd);
+    start = now();
+    if (mm_init() < 0)
+	rc = -1;
+    for (i = 0; rc == 0 && i < t->num_ops; i++) {
+	struct op *op = &t->ops[i];
+
+	switch (op->type) {
+	case 'a':
+	    blocks[op->id] = lifetime_hints ? mm_malloc_hint(op->size, op->life)
+					    : mm_malloc(op->size);
+	    if (blocks[op->id] == NULL)
+		rc = -1;
+	    live += sizes[op->id] = op->size;
+	    break;
+	case 'r':
+	    if ((blocks[op->id] = mm_realloc(blocks[op->id], op->size)) == NULL)
+		rc = -1;
+	    live += op->size - sizes[op->id];
+	    sizes[op->id] = op->size;
+	    break;
+	case 'f':
+	    if (gc_leak && rand() % 100 < gc_leak)
+		blocks[op->id] = NULL;      /* garbage for the collector */
+	    else
+		mm_free(blocks[op->id]);
+	    live -= sizes[op->id];
+	    sizes[op->id] = 0;
+	    break;
+	}
+	if (live > peak)
+	    peak = live;
+	if (i == peak_op && rc == 0) {
+	    pause = now();
+	    if (mm_heap_analyze(&r->heap, map) < 0)
+		perror(map);
+	    start += now() - pause;
+	}
+    }
+    r->secs = now() - start;
+    accesses = perf_stop(dtlb_access_fd);
+    misses = perf_stop(dtlb_miss_fd);
+    r->dtlb_miss = (accesses > 0 && misses >= 0) ? (double)misses / accesses : -1;
+    r->thp = thp_coverage(mem_heap_lo(), (char *)mem_heap_hi() + 1);
+    r->faults = faults() - faults0;
+    r->util = mem_heapsize() ? (double)peak / mem_heapsize() : 0;
+    mm_get_stats(&r->st);
+    r->verify_errors = mm_verify_errors();
+    if (heap_flags & MM_LATENCY)
+	latency_tail(r);
+    if (gc_leak)
+	mm_gc_remove_root(blocks);
+
+    free(blocks);
+    free(sizes);
+    return rc;
+}
+
+/*
+ * policy_table - Throughput and utilization of every trace under every
+ *                placement policy, one row per trace
+ */
+static void policy_table(int ntraces, char **paths)
+{
+    int npolicies = sizeof(policies) / sizeof(policies[0]);
+    double kops_sum[npolicies], util_sum[npolicies];
+    unsigned long tail[ntraces][npolicies], visits[ntraces][npolicies];
+    const char *names[ntraces];
+    struct result r;
+    int i, j;
+
+    printf("%-24s", "Kops/s | util");
+    for (j = 0; j < npolicies; j++) {
+	printf(" %15s", policies[j].name);
+	kops_sum[j] = util_sum[j] = 0;
+    }
+    printf("\n");
+
+    for (i = 0; i < ntraces; i++) {
+	struct trace *t = read_trace(paths[i]);
+
+	printf("%-24s", t->name);
+	names[i] = t->name;
+	for (j = 0; j < npolicies; j++) {
+	    fit_policy = policies[j].policy;
+	    tail[i][j] = visits[i][j] = 0;
+	    if (replay(t, &r) < 0) {
+		printf(" %15s", "failed");
+		continue;
+	    }
+	    tail[i][j] = r.tail_cycles;
+	    visits[i][j] = r.max_visits;
+	    kops_sum[j] += t->num_ops / r.secs / 1e3;
+	    util_sum[j] += r.util;
+	    printf(" %8.0f %5.1f%%", t->num_ops / r.secs / 1e3, 100 * r.util);
+	}
+	printf("\n");
+	free(t->ops);
+	free(t);
+    }
+
+    printf("%-24s", "mean");
+    for (j = 0; j < npolicies; j++)
+	printf(" %8.0f %5.1f%%", kops_sum[j] / ntraces,
+	       100 * util_sum[j] / ntraces);
+    printf("\n");
+
+    if (!(heap_flags & MM_LATENCY))
+	return;
+    printf("\n%-24s", "p99.9 cycles | visits");
+    for (j = 0; j < npolicies; j++)
+	printf(" %15s", policies[j].name);
+    printf("\n");
+    for (i = 0; i < ntraces; i++) {
+	printf("%-24s", names[i]);
+	for (j = 0; j < npolicies; j++)
+	    printf(" %8lu %6lu", tail[i][j], visits[i][j]);
+	printf("\n");
+    }
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-g] [-p] [-m] [-H] [-L] [-P] [-k K] [-V budget] "
+	    "[-v period] [-G pct] [-M prefix] [-T] trace.rep ...\n"
+	    "       %s -F size\n"
+	    "       %s -R soft_kb\n"
+	    "       %s -C\n"
+	    "       %s -S strings\n", prog, prog, prog, prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    struct result r;
+    size_t free_size = 0, soft_kb = 0;
+    int by_policy = 0, by_class = 0, strings = 0, c, i;
+
+    while ((c = getopt(argc, argv, "gpmHLPk:V:v:G:F:R:CS:M:T")) != -1) {
+	switch (c) {
+	case 'g': heap_flags |= MM_FIXED_CHUNK; break;
+	case 'p': heap_flags |= MM_PREFAULT; break;
+	case 'm': heap_flags |= MM_PAGEMAP; break;
+	case 'H': heap_flags |= MM_HUGEPAGE; break;
+	case 'L': lifetime_hints = 1; break;
+	case 'P': by_policy = 1; break;
+	case 'k': fit_k = atoi(optarg); break;
+	case 'V': verify_budget = atoi(optarg); break;
+	case 'v': verify_period = atoi(optarg); break;
+	case 'G': gc_leak = atoi(optarg); heap_flags |= MM_GC; break;
+	case 'F': free_size = atol(optarg); break;
+	case 'R': soft_kb = atol(optarg); break;
+	case 'C': by_class = 1; break;
+	case 'S': strings = atoi(optarg); break;
+	case 'M': map_prefix = optarg; break;
+	case 'T': heap_flags |= MM_LATENCY; break;
+	default: usage(argv[0]);
+	}
+    }
+
+    mem_init();
+    if (free_size) {
+	free_bench(free_size);
+	mem_deinit();
+	return 0;
+    }
+    if (by_class) {
+	class_bench();
+	mem_deinit();
+	return 0;
+    }
+    if (strings > 0) {
+	string_bench(strings);
+	mem_deinit();
+	return 0;
+    }
+    if (soft_kb) {
+	limit_bench(soft_kb * 1024);
+	c = layer_limit(soft_kb * 1024);
+	mem_deinit();
+	return c;
+    }
+    if (optind == argc)
+	usage(argv[0]);
+
+    dtlb_access_fd = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			       (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			       (PERF_COUNT_HW_CACHE_RESULT_ACCESS << 16));
+    dtlb_miss_fd = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+			     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    if (by_policy) {
+	policy_table(argc - optind, argv + optind);
+	mem_deinit();
+	return 0;
+    }
+    printf("%-24s %8s %10s %6s %7s %9s %8s %9s %7s %6s\n", "trace", "ops",
+	   "Kops/s", "util", "grows", "heap(KB)", "faults", "prefault",
+	   "dTLB%", "THP%");
+    for (i = optind; i < argc; i++) {
+	struct trace *t = read_trace(argv[i]);
+
+	if (replay(t, &r) < 0)
+	    printf("%-24s failed\n", t->name);
+	else
+	    printf("%-24s %8d %10.0f %5.1f%% %7lu %9lu %8ld %9lu %7.3f %5.1f%%\n",
+		   t->name, t->num_ops, t->num_ops / r.secs / 1e3, 100 * r.util,
+		   r.st.sbrk_calls, r.st.sbrk_bytes / 1024, r.faults,
+		   r.st.prefault_pages,
+		   r.dtlb_miss < 0 ? -1 : 100 * r.dtlb_miss,
+		   r.thp < 0 ? -1 : 100 * r.thp);
+	if (r.verify_errors)
+	    printf("%-24s verifier found %ld problems\n", "", r.verify_errors);
+	if (gc_leak)
+	    printf("%-24s %lu collections freed %lu KB, pause avg %.0f us, "
+		   "max %.0f us\n", "", r.st.gc_runs, r.st.gc_bytes / 1024,
+		   r.st.gc_runs ? r.st.gc_ns / 1e3 / r.st.gc_runs : 0,
+		   r.st.gc_max_ns / 1e3);
+	if (map_prefix && r.heap.heap_bytes)
+	    printf("%-24s at peak: %lu KB free in %lu blocks, largest %lu KB, "
+		   "fragmentation %.3f\n", "", r.heap.free_bytes / 1024,
+		   r.heap.free_blocks, r.heap.largest_free / 1024, r.heap.frag);
+	if (heap_flags & MM_LATENCY)
+	    mm_dump_latency(stdout);
+	free(t->ops);
+	free(t);
+    }
+    mem_deinit();
+    return 0;
+}
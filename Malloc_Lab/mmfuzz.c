@@ -0,0 +1,574 @@
+/*
+ * mmfuzz.c - random operation fuzzer and throughput gate for mm.c
+ *
+ * mmfuzz generates a random sequence of mm_malloc, mm_calloc,
+ * mm_malloc_flags(MM_CACHELINE), mm_memalign, mm_realloc, mm_try_expand
+ * and mm_free calls over a table
+ * of slots, from a seed, and runs it twice.
+ *
+ * The checked run keeps a shadow interval map, the live payloads sorted
+ * by address, and checks every block mm.c returns: that it is aligned,
+ * lies inside the heap, overlaps no other live payload, and has at least
+ * mm_usable_size bytes as asked. A cache line block must stay on its own
+ * lines through every realloc and expand: no other live payload may
+ * share one with it. Payloads are filled with a byte of their
+ * slot, which is checked before every free and after every realloc, and
+ * calloc's must come back zero. Every check_every operations it runs
+ * mm_checkheap, which reports by printing, so its output is captured and
+ * any output is a failure; with -V the incremental verifier runs too and
+ * any problem it counts is a failure. With -g some frees leak instead,
+ * dropping the pointer for MM_GC to collect, and a run that collects
+ * more than once per GC_BYTES of blocks it allocated fails too:
+ * collections should follow what is allocated, not every free list
+ * miss. The first failure, or a crash, prints the seed, the operation
+ * and the problem, and exits 1, so
+ * `mmfuzz -s seed -n ops` replays it; -c 1 finds a corruption soonest.
+ *
+ * The timed run replays the same operations on a fresh heap with no
+ * checks and no payload writes, repeats times, and reports the best
+ * rate. With -b the rate is compared against the line for the same
+ * configuration in a baseline file and mmfuzz exits 2 if it is more than
+ * tolerance percent slower; -w records the rate there instead, replacing
+ * that configuration's line.
+ *
+ * usage: mmfuzz [-s seed] [-n ops] [-l slots] [-f flags] [-p policy]
+ *               [-c check_every] [-V budget] [-g pct] [-z size]
+ *               [-r repeats]
+ *               [-b baseline | -w baseline] [-t tolerance]
+ *   -s   seed (default 1)
+ *   -n   operations (default 200000)
+ *   -l   slots, the most blocks live at once (default 512, which keeps
+ *        the live bytes well inside memlib's MAX_HEAP)
+ *   -f   MM_* heap flags, in any base strtol takes
+ *   -p   MM_* placement policy
+ *   -c   run mm_checkheap every check_every operations (default 1000)
+ *   -V   incremental verifier budget (mm_set_verify), checked every call
+ *   -g   percent of frees that leak instead; meant for -f with MM_GC
+ *   -z   largest payload size, to fit more slots in the heap
+ *   -r   timed runs to take the best of (default 3)
+ *   -t   slowdown tolerated by -b, in percent (default 10)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+
+#define ALIGNMENT 8     /* what mm_malloc guarantees */
+#define CACHELINE 64    /* what MM_CACHELINE isolates */
+#define KEY_LEN   128   /* baseline configuration key */
+#define GC_BYTES  (1<<20) /* with MM_GC, fewest bytes allocated per
+			     collection (mm.c's GC_MIN) */
+
+/* One generated operation */
+struct op {
+    char type;      /* 'm'alloc, 'c'alloc, 'k' cache line malloc,
+		       'a'ligned, 'r'ealloc, 'e'xpand, 'f'ree, 'l'eak */
+    int slot;
+    size_t size;    /* payload bytes */
+    size_t align;   /* for 'a' */
+};
+
+/* A live payload in the shadow map */
+struct interval {
+    uintptr_t lo, hi;
+    int slot;
+    int lined;      /* has its cache lines to itself */
+};
+
+static struct op *ops;
+static int num_ops = 200000, num_slots = 512;
+static unsigned seed = 1;
+static int heap_flags, fit_policy = MM_NEXT_FIT;
+static int check_every = 1000, verify_budget;
+static int leak_pct;            /* percent of frees that leak instead */
+static size_t max_size;         /* largest payload, 0 for pick_size's */
+
+static void **slot_ptr;         /* the slot's block, NULL if free */
+static size_t *slot_size;       /* bytes asked for (or expanded to) */
+static char *slot_lined;        /* allocated with MM_CACHELINE */
+static struct interval *shadow; /* sorted by lo */
+static int nshadow;
+static int cur_op;              /* for failure reports */
+static size_t alloc_bytes;      /* block bytes the checked run got */
+
+/*
+ * pick_size - A payload size: mostly small, sometimes up to 256KB
+ */
+static size_t pick_size(void)
+{
+    int r = rand() % 100;
+
+    if (r < 60)
+	return rand() % 64 + 1;
+    if (r < 85)
+	return rand() % 960 + 65;
+    if (r < 97)
+	return rand() % 15360 + 1025;
+    return rand() % (256 << 10) + 16385;
+}
+
+/*
+ * generate - Fill ops from the seed, tracking which slots are live
+ */
+static void generate(void)
+{
+    char *live = calloc(num_slots, 1);
+    int i, r;
+
+    ops = malloc(num_ops * sizeof(struct op));
+    if (live == NULL || ops == NULL) {
+	perror("mmfuzz");
+	exit(1);
+    }
+    srand(seed);
+    for (i = 0; i < num_ops; i++) {
+	struct op *op = &ops[i];
+
+	op->slot = rand() % num_slots;
+	op->size = pick_size();
+	if (max_size && op->size > max_size)
+	    op->size = op->size % max_size + 1;
+	op->align = 0;
+	r = rand() % 100;
+	if (!live[op->slot]) {
+	    if (r < 62)
+		op->type = 'm';
+	    else if (r < 70)
+		op->type = 'k';
+	    else if (r < 85)
+		op->type = 'c';
+	    else {
+		op->type = 'a';
+		op->align = (size_t)16 << rand() % 9;  /* 16 to 4096 */
+	    }
+	    live[op->slot] = 1;
+	}
+	else if (r < 50) {
+	    op->type = leak_pct && rand() % 100 < leak_pct ? 'l' : 'f';
+	    live[op->slot] = 0;
+	}
+	else
+	    op->type = r < 85 ? 'r' : 'e';
+    }
+    free(live);
+}
+
+/*
+ * fail - Report the failing operation and the problem, which may print
+ *        p with %p, and exit
+ */
+static void fail(const char *fmt, void *p)
+{
+    struct op *op = &ops[cur_op];
+
+    printf("mmfuzz: seed %u op %d (%c slot %d size %zu align %zu): ", seed,
+	   cur_op, op->type, op->slot, op->size, op->align);
+    printf(fmt, p);
+    printf("\n");
+    exit(1);
+}
+
+/*
+ * crashed - A fault in mm.c or a payload: report the operation
+ */
+static void crashed(int sig)
+{
+    fail(sig == SIGSEGV ? "crashed (SIGSEGV)" : "crashed (SIGBUS)", NULL);
+}
+
+/*
+ * shadow_find - Index of the first interval that ends above lo
+ */
+static int shadow_find(uintptr_t lo)
+{
+    int a = 0, b = nshadow;
+
+    while (a < b) {
+	int m = (a + b) / 2;
+
+	if (shadow[m].hi <= lo)
+	    a = m + 1;
+	else
+	    b = m;
+    }
+    return a;
+}
+
+/*
+ * same_line - Whether the last byte before hi and lo share a cache line
+ */
+static int same_line(uintptr_t hi, uintptr_t lo)
+{
+    return (hi - 1) / CACHELINE == lo / CACHELINE;
+}
+
+/*
+ * shadow_add - Check slot's new payload [p, p+size) and map it
+ */
+static void shadow_add(int slot, void *p, size_t size, size_t align,
+		       int lined)
+{
+    uintptr_t lo = (uintptr_t)p, hi = lo + size;
+    int i;
+
+    if (p == NULL)
+	fail("returned NULL", p);
+    if (lo % align)
+	fail("%p is misaligned", p);
+    if (p < mem_heap_lo() || (char *)hi - 1 > (char *)mem_heap_hi())
+	fail("%p is outside the heap", p);
+    if (mm_usable_size(p) < size)
+	fail("%p has fewer usable bytes than asked for", p);
+    i = shadow_find(lo);
+    if (i < nshadow && shadow[i].lo < hi)
+	fail("%p overlaps a live block", p);
+    if (lined && lo % CACHELINE)
+	fail("%p is not on a cache line", p);
+    if ((i > 0 && (lined || shadow[i-1].lined)
+	 && same_line(shadow[i-1].hi, lo))
+	|| (i < nshadow && (lined || shadow[i].lined)
+	    && same_line(hi, shadow[i].lo)))
+	fail("%p shares a cache line with a cache line block", p);
+    memmove(&shadow[i + 1], &shadow[i], (nshadow - i) * sizeof(struct interval));
+    shadow[i].lo = lo;
+    shadow[i].hi = hi;
+    shadow[i].slot = slot;
+    shadow[i].lined = lined;
+    nshadow++;
+}
+
+/*
+ * shadow_remove - Unmap the payload at p
+ */
+static void shadow_remove(void *p)
+{
+    int i = shadow_find((uintptr_t)p);
+
+    if (i == nshadow || shadow[i].lo != (uintptr_t)p)
+	fail("%p is not in the shadow map", p);
+    memmove(&shadow[i], &shadow[i + 1], (nshadow - i - 1) * sizeof(struct interval));
+    nshadow--;
+}
+
+/*
+ * check_fill - Check that the first n bytes of p are still slot's byte
+ */
+static void check_fill(void *p, size_t n, int slot)
+{
+    unsigned char *q = p, c = (unsigned char)slot;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+	if (q[i] != c)
+	    fail("payload of %p was overwritten", p);
+}
+
+/*
+ * checkheap_quiet - Run mm_checkheap; 1 if it printed nothing, else
+ *                   echo the start of what it printed
+ */
+static int checkheap_quiet(void)
+{
+    FILE *tmp = tmpfile();
+    char line[256];
+    int saved, clean, n = 0;
+
+    if (tmp == NULL) {
+	perror("tmpfile");
+	exit(1);
+    }
+    fflush(stdout);
+    saved = dup(STDOUT_FILENO);
+    dup2(fileno(tmp), STDOUT_FILENO);
+    mm_checkheap(0);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    clean = lseek(fileno(tmp), 0, SEEK_END) == 0;
+    rewind(tmp);
+    while (!clean && n++ < 20 && fgets(line, sizeof(line), tmp))
+	fputs(line, stdout);
+    fclose(tmp);
+    return clean;
+}
+
+/*
+ * start_heap - A fresh heap with the configured flags and policy
+ */
+static void start_heap(int verify)
+{
+    mem_deinit();
+    mem_init();
+    mm_set_flags(heap_flags);
+    mm_set_policy(fit_policy, 0);
+    mm_set_verify(verify, 1);    /* every call: catch problems early */
+    if (mm_init() < 0) {
+	printf("mmfuzz: mm_init failed\n");
+	exit(1);
+    }
+    memset(slot_ptr, 0, num_slots * sizeof(void *));
+    if (heap_flags & MM_GC)
+	mm_gc_add_root(slot_ptr, num_slots * sizeof(void *));
+}
+
+/*
+ * run_checked - Run ops checking every result
+ */
+static void run_checked(void)
+{
+    struct mm_stats st;
+    unsigned char *p;
+    size_t old, i;
+
+    start_heap(verify_budget);
+    nshadow = 0;
+    alloc_bytes = 0;
+    for (cur_op = 0; cur_op < num_ops; cur_op++) {
+	struct op *op = &ops[cur_op];
+	int s = op->slot;
+
+	switch (op->type) {
+	case 'm':
+	case 'c':
+	case 'k':
+	case 'a':
+	    if (op->type == 'm')
+		p = mm_malloc(op->size);
+	    else if (op->type == 'c')
+		p = mm_calloc(op->size, 1);
+	    else if (op->type == 'k')
+		p = mm_malloc_flags(op->size, MM_CACHELINE);
+	    else
+		p = mm_memalign(op->align, op->size);
+	    slot_lined[s] = op->type == 'k';
+	    shadow_add(s, p, op->size, op->align ? op->align : ALIGNMENT,
+		       slot_lined[s]);
+	    if (op->type == 'c')
+		for (i = 0; i < op->size; i++)
+		    if (p[i])
+			fail("calloc'd %p is not zero", p);
+	    memset(p, s, op->size);
+	    slot_ptr[s] = p;
+	    slot_size[s] = op->size;
+	    alloc_bytes += mm_usable_size(p) + ALIGNMENT;
+	    break;
+	case 'r':
+	    shadow_remove(slot_ptr[s]);
+	    p = mm_realloc(slot_ptr[s], op->size);
+	    shadow_add(s, p, op->size, ALIGNMENT, slot_lined[s]);
+	    old = slot_size[s];
+	    check_fill(p, old < op->size ? old : op->size, s);
+	    if (op->size > old)
+		memset(p + old, s, op->size - old);
+	    if (p != slot_ptr[s])
+		alloc_bytes += mm_usable_size(p) + ALIGNMENT;
+	    slot_ptr[s] = p;
+	    slot_size[s] = op->size;
+	    break;
+	case 'e':
+	    p = slot_ptr[s];
+	    old = slot_size[s];
+	    if (op->size <= old || !mm_try_expand(p, op->size))
+		break;
+	    shadow_remove(p);
+	    shadow_add(s, p, op->size, ALIGNMENT, slot_lined[s]);
+	    check_fill(p, old, s);
+	    memset(p + old, s, op->size - old);
+	    slot_size[s] = op->size;
+	    break;
+	case 'f':
+	    check_fill(slot_ptr[s], slot_size[s], s);
+	    shadow_remove(slot_ptr[s]);
+	    mm_free(slot_ptr[s]);
+	    slot_ptr[s] = NULL;
+	    break;
+	case 'l':
+	    /* the collector may reuse it from now on */
+	    check_fill(slot_ptr[s], slot_size[s], s);
+	    shadow_remove(slot_ptr[s]);
+	    slot_ptr[s] = NULL;
+	    break;
+	}
+	if (check_every && cur_op % check_every == 0 && !checkheap_quiet())
+	    fail("mm_checkheap found problems", NULL);
+	if (verify_budget && mm_verify_errors())
+	    fail("the verifier found problems", NULL);
+    }
+    cur_op = num_ops - 1;
+    if (!checkheap_quiet())
+	fail("mm_checkheap found problems at the end", NULL);
+    if (heap_flags & MM_GC) {
+	mm_gc_remove_root(slot_ptr);
+	mm_get_stats(&st);
+	printf("%lu collections for %zu KB allocated\n", st.gc_runs,
+	       alloc_bytes / 1024);
+	if (st.gc_runs > alloc_bytes / GC_BYTES + 1) {
+	    printf("mmfuzz: seed %u: more than one collection per %d KB "
+		   "allocated\n", seed, GC_BYTES / 1024);
+	    exit(1);
+	}
+    }
+}
+
+/*
+ * run_timed - Seconds to run ops with no checks
+ */
+static double run_timed(void)
+{
+    struct timespec t0, t1;
+
+    start_heap(0);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (cur_op = 0; cur_op < num_ops; cur_op++) {
+	struct op *op = &ops[cur_op];
+	int s = op->slot;
+
+	switch (op->type) {
+	case 'm': slot_ptr[s] = mm_malloc(op->size); break;
+	case 'c': slot_ptr[s] = mm_calloc(op->size, 1); break;
+	case 'k': slot_ptr[s] = mm_malloc_flags(op->size, MM_CACHELINE); break;
+	case 'a': slot_ptr[s] = mm_memalign(op->align, op->size); break;
+	case 'r': slot_ptr[s] = mm_realloc(slot_ptr[s], op->size); break;
+	case 'e': mm_try_expand(slot_ptr[s], op->size); break;
+	case 'f': mm_free(slot_ptr[s]); break;
+	case 'l': slot_ptr[s] = NULL; break;
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (heap_flags & MM_GC)
+	mm_gc_remove_root(slot_ptr);
+    return t1.tv_sec - t0.tv_sec + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+/*
+ * gate - Compare kops with the baseline for key, or record it there if
+ *        writing; returns the exit status
+ */
+static int gate(const char *path, int writing, const char *key, double kops,
+		double tolerance)
+{
+    char line[KEY_LEN + 64], **lines = NULL;
+    double base = -1;
+    int n = 0, i, rc = 0;
+    size_t len = strlen(key);
+    FILE *f = fopen(path, "r");
+
+    /* keep the other configurations' lines */
+    while (f && fgets(line, sizeof(line), f)) {
+	if (strncmp(line, key, len) == 0 && line[len] == ' ') {
+	    base = atof(line + len + 1);
+	    continue;
+	}
+	lines = realloc(lines, (n + 1) * sizeof(char *));
+	lines[n++] = strdup(line);
+    }
+    if (f)
+	fclose(f);
+
+    if (writing) {
+	if ((f = fopen(path, "w")) == NULL) {
+	    perror(path);
+	    return 1;
+	}
+	for (i = 0; i < n; i++)
+	    fputs(lines[i], f);
+	fprintf(f, "%s %.0f\n", key, kops);
+	if (fclose(f) != 0) {
+	    perror(path);
+	    rc = 1;
+	}
+	printf("baseline %s: %.0f Kops/s\n", path, kops);
+    }
+    else if (base < 0)
+	printf("baseline %s: no line for this configuration\n", path);
+    else {
+	printf("baseline %.0f Kops/s, now %+.1f%%", base, 100 * (kops / base - 1));
+	if (kops < base * (1 - tolerance / 100)) {
+	    printf(": slower than the %.0f%% tolerance\n", tolerance);
+	    rc = 2;
+	}
+	else
+	    printf(": ok\n");
+    }
+    for (i = 0; i < n; i++)
+	free(lines[i]);
+    free(lines);
+    return rc;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-s seed] [-n ops] [-l slots] [-f flags] "
+	    "[-p policy] [-c check_every]\n"
+	    "       [-V budget] [-g pct] [-z size] [-r repeats] [-b baseline | -w baseline] "
+	    "[-t tolerance]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *baseline = NULL;
+    char key[KEY_LEN];
+    double secs, best = 0, tolerance = 10;
+    int repeats = 3, writing = 0, c, i;
+
+    while ((c = getopt(argc, argv, "s:n:l:f:p:c:V:g:z:r:b:w:t:")) != -1) {
+	switch (c) {
+	case 's': seed = strtoul(optarg, NULL, 0); break;
+	case 'n': num_ops = atoi(optarg); break;
+	case 'l': num_slots = atoi(optarg); break;
+	case 'f': heap_flags = strtol(optarg, NULL, 0); break;
+	case 'p': fit_policy = atoi(optarg); break;
+	case 'c': check_every = atoi(optarg); break;
+	case 'V': verify_budget = atoi(optarg); break;
+	case 'g': leak_pct = atoi(optarg); break;
+	case 'z': max_size = strtoul(optarg, NULL, 0); break;
+	case 'r': repeats = atoi(optarg); break;
+	case 'b': baseline = optarg; writing = 0; break;
+	case 'w': baseline = optarg; writing = 1; break;
+	case 't': tolerance = atof(optarg); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc || num_ops <= 0 || num_slots <= 0)
+	usage(argv[0]);
+
+    slot_ptr = calloc(num_slots, sizeof(void *));
+    slot_size = calloc(num_slots, sizeof(size_t));
+    slot_lined = calloc(num_slots, 1);
+    shadow = malloc(num_slots * sizeof(struct interval));
+    if (slot_ptr == NULL || slot_size == NULL || slot_lined == NULL
+	|| shadow == NULL) {
+	perror("mmfuzz");
+	return 1;
+    }
+    generate();
+    signal(SIGSEGV, crashed);
+    signal(SIGBUS, crashed);
+    mem_init();
+
+    run_checked();
+    printf("seed %u: %d ops over %d slots checked, heap checked every %d\n",
+	   seed, num_ops, num_slots, check_every);
+
+    for (i = 0; i < repeats; i++) {
+	secs = run_timed();
+	if (num_ops / secs / 1e3 > best)
+	    best = num_ops / secs / 1e3;
+    }
+    printf("%.0f Kops/s (best of %d)\n", best, repeats);
+    mem_deinit();
+
+    if (baseline == NULL)
+	return 0;
+    snprintf(key, sizeof(key), "seed=%u ops=%d slots=%d flags=%#x policy=%d",
+	     seed, num_ops, num_slots, heap_flags, fit_policy);
+    return gate(baseline, writing, key, best, tolerance);
+}
@@ -0,0 +1,220 @@
+/*
+ * mmheapmap.c - draw a heap map written by mm_heap_analyze
+ *
+ * The map is the heap as runs of allocated and free bytes. mmheapmap
+ * prints the free run statistics again (free runs are free blocks, or
+ * several of them before they coalesce) and draws the heap, low
+ * addresses first, as rows of cells covering equal shares of it. A cell
+ * shows how much of its share is allocated: '#' all of it, '+' most,
+ * '-' some, '.' none. With -p it also writes a PPM image of the same
+ * layout at PPM_SCALE times the resolution, a pixel darker the more of
+ * its share is allocated, where thin free gaps between live blocks stay
+ * visible in a large heap.
+ *
+ * usage: mmheapmap [-w width] [-r rows] [-p image.ppm] heap.map
+ *   -w   cells per row (default 64)
+ *   -r   rows (default 32)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MAX_BINS  64    /* free run histogram bins, by log2 size */
+#define PPM_SCALE 8     /* image pixels per cell, across and down */
+
+/* One run of the map */
+struct run {
+    int alloc;
+    size_t bytes;
+};
+
+static struct run *runs;
+static size_t nruns;
+static size_t heap_bytes;
+
+/*
+ * read_map - Load the map; exits on malformed input
+ */
+static void read_map(const char *path)
+{
+    size_t cap = 1024, total = 0;
+    char type[2];
+    FILE *f = fopen(path, "r");
+
+    if (f == NULL) {
+	perror(path);
+	exit(1);
+    }
+    if (fscanf(f, "mmheap %zu", &heap_bytes) != 1) {
+	fprintf(stderr, "%s: not a heap map\n", path);
+	exit(1);
+    }
+    runs = malloc(cap * sizeof(struct run));
+    while (runs && fscanf(f, "%1s %zu", type, &runs[nruns].bytes) == 2) {
+	if (type[0] != 'a' && type[0] != 'f') {
+	    fprintf(stderr, "%s: bad run type %c\n", path, type[0]);
+	    exit(1);
+	}
+	runs[nruns].alloc = type[0] == 'a';
+	total += runs[nruns].bytes;
+	if (++nruns == cap)
+	    runs = realloc(runs, (cap *= 2) * sizeof(struct run));
+    }
+    if (runs == NULL) {
+	perror("mmheapmap");
+	exit(1);
+    }
+    if (total != heap_bytes)
+	fprintf(stderr, "%s: runs add up to %zu bytes, not %zu\n", path,
+		total, heap_bytes);
+    fclose(f);
+}
+
+/*
+ * summary - Free bytes, largest free run, fragmentation index and a
+ *           histogram of the free runs
+ */
+static void summary(void)
+{
+    unsigned long hist[MAX_BINS] = { 0 }, hist_bytes[MAX_BINS] = { 0 };
+    size_t free_bytes = 0, largest = 0, i;
+    unsigned long nfree = 0;
+    int bin;
+
+    for (i = 0; i < nruns; i++) {
+	if (runs[i].alloc)
+	    continue;
+	nfree++;
+	free_bytes += runs[i].bytes;
+	if (runs[i].bytes > largest)
+	    largest = runs[i].bytes;
+	for (bin = 0; bin < MAX_BINS - 1 && runs[i].bytes >> (bin + 1); bin++)
+	    ;
+	hist[bin]++;
+	hist_bytes[bin] += runs[i].bytes;
+    }
+    printf("heap %zu KB, %zu runs, free %zu KB in %lu runs (%.1f%%), "
+	   "largest %zu KB, fragmentation %.3f\n", heap_bytes / 1024, nruns,
+	   free_bytes / 1024, nfree,
+	   heap_bytes ? 100.0 * free_bytes / heap_bytes : 0, largest / 1024,
+	   free_bytes ? 1 - (double)largest / free_bytes : 0);
+    printf("%12s %8s %10s\n", "free run", "runs", "KB");
+    for (bin = 0; bin < MAX_BINS; bin++)
+	if (hist[bin])
+	    printf("%11luB %8lu %10lu\n", 1UL << bin, hist[bin],
+		   hist_bytes[bin] / 1024);
+}
+
+/*
+ * cells - Fraction of each of n equal shares of the heap that is
+ *         allocated
+ */
+static double *cells(size_t n)
+{
+    double *alloc = calloc(n, sizeof(double));
+    double share = (double)heap_bytes / n, pos = 0, end, cut;
+    size_t i, c;
+
+    if (alloc == NULL) {
+	perror("mmheapmap");
+	exit(1);
+    }
+    for (i = 0; i < nruns; i++) {
+	/* spread the run over the cells it overlaps */
+	end = pos + runs[i].bytes;
+	for (c = pos / share; c < n && c * share < end; c++) {
+	    cut = (end < (c + 1) * share ? end : (c + 1) * share)
+		- (pos > c * share ? pos : c * share);
+	    if (runs[i].alloc)
+		alloc[c] += cut / share;
+	}
+	pos = end;
+    }
+    return alloc;
+}
+
+/*
+ * draw - Print the heap as rows of width cells
+ */
+static void draw(int width, int rows)
+{
+    double *alloc = cells((size_t)width * rows);
+    int r, c;
+
+    printf("%zu bytes per cell, '#' allocated, '.' free\n",
+	   heap_bytes / ((size_t)width * rows));
+    for (r = 0; r < rows; r++) {
+	for (c = 0; c < width; c++) {
+	    double a = alloc[(size_t)r * width + c];
+
+	    putchar(a > 0.999 ? '#' : a >= 0.5 ? '+' : a > 0.001 ? '-' : '.');
+	}
+	putchar('\n');
+    }
+    free(alloc);
+}
+
+/*
+ * write_ppm - Write the heap as a gray image of PPM_SCALE times as many
+ *             rows of PPM_SCALE times as many cells
+ */
+static void write_ppm(const char *path, int width, int rows)
+{
+    size_t n, i;
+    double *alloc;
+    FILE *f;
+    unsigned char gray;
+
+    width *= PPM_SCALE;
+    rows *= PPM_SCALE;
+    n = (size_t)width * rows;
+    alloc = cells(n);
+    if ((f = fopen(path, "wb")) == NULL) {
+	perror(path);
+	exit(1);
+    }
+    fprintf(f, "P6\n%d %d\n255\n", width, rows);
+    for (i = 0; i < n; i++) {
+	gray = alloc[i] >= 1 ? 0 : 255 - (unsigned char)(alloc[i] * 255 + 0.5);
+	putc(gray, f);
+	putc(gray, f);
+	putc(gray, f);
+    }
+    if (fclose(f) != 0)
+	perror(path);
+    free(alloc);
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-w width] [-r rows] [-p image.ppm] heap.map\n",
+	    prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *ppm = NULL;
+    int width = 64, rows = 32, c;
+
+    while ((c = getopt(argc, argv, "w:r:p:")) != -1) {
+	switch (c) {
+	case 'w': width = atoi(optarg); break;
+	case 'r': rows = atoi(optarg); break;
+	case 'p': ppm = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || width <= 0 || rows <= 0)
+	usage(argv[0]);
+
+    read_map(argv[optind]);
+    summary();
+    if (heap_bytes == 0)
+	return 0;
+    draw(width, rows);
+    if (ppm)
+	write_ppm(ppm, width, rows);
+    return 0;
+}
@@ -0,0 +1,890 @@
+/*
+ * mtbench.c - multithreaded allocator stress benchmarks
+ *
+ * Workloads, after the classic allocator papers:
+ *   larson        server-like: each thread replaces random slots in an
+ *                 array of live objects, then hands the array to the next
+ *                 thread, which frees what the previous one allocated
+ *   threadtest    per-thread churn: allocate a batch, free the batch
+ *   xmalloc       producer/consumer: half the threads allocate and queue
+ *                 objects, the other half dequeue and free them
+ *   cache-scratch false sharing: each thread frees an object handed to it
+ *                 by the main thread, then reallocates and writes to
+ *                 objects of the same size in a tight loop
+ *   burst         bursts of tiny, short-lived objects: allocate a few
+ *                 hundred of 8-32 bytes, write each, free them all
+ *   stress        hammers the smallest classes: allocate a handful of
+ *                 objects, stamp each with the thread and a sequence
+ *                 number, check the stamps, free them; a stamp changed
+ *                 behind a thread's back means an object was handed out
+ *                 twice, and aborts the run
+ *
+ * Each workload is run with 1..N threads and reports ops/s and resident
+ * set size. The allocator under test is picked with -a:
+ *   glibc         malloc/free
+ *   mm            mm_malloc/mm_free from mm.c, which is not thread safe,
+ *                 so calls are serialized behind one mutex
+ *   mm-cl         as mm, with MM_CACHELINE placement so no two objects
+ *                 share a cache line (compare on cache-scratch)
+ *   mag           mm_mag.c magazines and depot over mm.c
+ *   numa          mm_numa.c arenas, one per node; frees from other nodes
+ *                 go to the owner's remote list
+ *   lf            mm_lf.c lock-free shared pools for the smallest classes
+ *   lf-mutex      the same pools, each guarded by a mutex instead
+ *   bg            as mm, but frees are deferred to mm_bg.c's maintenance
+ *                 thread, which also sorts free lists and trims when idle
+ *   tlab          mm_tlab.c thread-local bump buffers for the smallest
+ *                 sizes, reclaimed whole when their objects are all freed
+ *
+ * With -l, every malloc and free is also timed, and the median, 99th and
+ * 99.9th percentile latencies of each are printed (in ns).
+ *
+ * With -B, no workload is run. Instead the main thread is pinned to each
+ * node in turn and memsets, then reads, a buffer from every node's arena,
+ * printing a local/remote bandwidth matrix in GB/s (rows: CPU node,
+ * columns: memory node).
+ *
+ * With -S, no workload is run either. Instead mm_shm.c is tested across
+ * processes: maxthreads children each allocate stamped blocks from one
+ * shared heap and exit, and the parent checks and frees every block.
+ * Then a child is killed while it holds the heap's lock, walking the
+ * heap for a fit that is not there; the parent's next malloc must take
+ * the lock back from the dead owner and succeed, and the heap must
+ * still check out. Exits 1 on any failure.
+ *
+ * usage: mtbench [-a alloc] [-w workload] [-t maxthreads] [-n ops] [-l] [-B]
+ *        mtbench -S [-t procs]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include "mm.h"
+#include "memlib.h"
+#include "mm_ext.h"
+#include "mm_mag.h"
+#include "mm_numa.h"
+#include "mm_lf.h"
+#include "mm_bg.h"
+#include "mm_tlab.h"
+#include "mm_shm.h"
+
+#define MAX_THREADS   64
+#define LARSON_SLOTS  1000
+#define LARSON_ROUNDS 8
+#define TT_BATCH      1000
+#define XM_QUEUE      4096
+#define CS_OBJSIZE    8
+#define CS_WRITES     1000
+#define ST_BATCH      8
+#define ST_MAXSIZE    64
+#define BURST_OBJS    256
+#define BURST_MAXSIZE 32
+#define NUMA_ARENA    (256 << 20)   /* bytes per node arena */
+#define BW_SIZE       (64 << 20)    /* bandwidth buffer */
+#define BW_PASSES     4
+#define LAT_MAX       (1 << 18)     /* latencies kept per thread and op */
+#define SHM_REGION    (16 << 20)    /* bytes in the -S shared heap */
+#define SHM_BLOCKS    2000          /* blocks each -S child leaves */
+#define SHM_MAXSIZE   1024          /* largest of them */
+#define SHM_FILL      50000         /* blocks for the dying child to walk */
+#define SHM_KILLS     20            /* tries at a kill inside the lock */
+
+/* Allocator under test */
+struct mt_alloc {
+    const char *name;
+    void (*reset)(void);        /* fresh heap before each run, may be NULL */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr, size_t size);   /* size as passed to malloc */
+};
+
+/* Workload: returns number of operations done by thread id of nthreads */
+struct workload {
+    const char *name;
+    void (*setup)(int nthreads);
+    long (*thread)(int id, int nthreads);
+};
+
+static const struct mt_alloc *A;
+static const struct mt_alloc *timed;    /* allocator under A when -l */
+static long nops = 200000;              /* ops per thread */
+static pthread_barrier_t barrier;       /* start line, main + workers */
+static pthread_barrier_t round_barrier; /* between larson rounds */
+
+/* xorshift, one state per thread */
+static uint32_t rnd(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+/*
+ * Allocators
+ */
+static void *libc_malloc(size_t size) { return malloc(size); }
+static void libc_free(void *ptr, size_t size) { free(ptr); }
+
+static void mm_reset(void)
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mm_init failed\n");
+	exit(1);
+    }
+}
+
+static void *mm_locked_malloc(size_t size)
+{
+    void *p;
+
+    mm_lock();
+    p = mm_malloc(size);
+    mm_unlock();
+    return p;
+}
+
+static void *mm_locked_malloc_cl(size_t size)
+{
+    void *p;
+
+    mm_lock();
+    p = mm_malloc_flags(size, MM_CACHELINE);
+    mm_unlock();
+    return p;
+}
+
+static void mm_locked_free(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+	return;
+    mm_lock();
+    mm_free(ptr);
+    mm_unlock();
+}
+
+static void mag_reset(void)
+{
+    /* cached objects belong to the old heap */
+    mm_mag_reap();
+    mm_reset();
+}
+
+static void numa_reset(void)
+{
+    static int done;
+
+    /* arenas live for the whole run; every workload frees what it made */
+    if (!done && mm_numa_init(NUMA_ARENA) < 0) {
+	fprintf(stderr, "mm_numa_init failed\n");
+	exit(1);
+    }
+    done = 1;
+}
+
+static void numa_free(void *ptr, size_t size) { mm_numa_free(ptr); }
+
+static void lf_reset(void)
+{
+    mm_lf_set_locked(0);
+    mm_lf_reap();
+    mm_reset();
+}
+
+static void lf_mutex_reset(void)
+{
+    mm_lf_reap();
+    mm_lf_set_locked(1);
+    mm_reset();
+}
+
+static void bg_reset(void)
+{
+    mm_bg_stop();
+    mm_reset();
+    if (mm_bg_start() != 0) {
+	fprintf(stderr, "mm_bg_start failed\n");
+	exit(1);
+    }
+}
+
+static void bg_free(void *ptr, size_t size) { mm_bg_free(ptr); }
+static void tlab_reset(void)
+{
+    /* the main thread's buffer (cache-scratch setup) is in the old heap */
+    mm_tlab_retire();
+    mm_reset();
+}
+
+static void tlab_free(void *ptr, size_t size) { mm_tlab_free(ptr); }
+
+static const struct mt_alloc allocs[] = {
+    { "glibc", NULL, libc_malloc, libc_free },
+    { "mm", mm_reset, mm_locked_malloc, mm_locked_free },
+    { "mm-cl", mm_reset, mm_locked_malloc_cl, mm_locked_free },
+    { "mag", mag_reset, mm_mag_malloc, mm_mag_free },
+    { "numa", numa_reset, mm_numa_malloc, numa_free },
+    { "lf", lf_reset, mm_lf_malloc, mm_lf_free },
+    { "lf-mutex", lf_mutex_reset, mm_lf_malloc, mm_lf_free },
+    { "bg", bg_reset, mm_bg_malloc, bg_free },
+    { "tlab", tlab_reset, mm_tlab_malloc, tlab_free },
+};
+
+/*
+ * Latency: with -l, A is lat_alloc, which times calls into the allocator
+ * under test, kept in timed
+ */
+struct lat_log {
+    long n;
+    uint32_t ns[LAT_MAX];
+};
+
+static struct lat_log *lat_malloc[MAX_THREADS], *lat_free[MAX_THREADS];
+static __thread int my_id;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lat_record(struct lat_log *log, uint64_t ns)
+{
+    if (log->n < LAT_MAX)
+	log->ns[log->n++] = ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+static void lat_reset(void)
+{
+    if (timed->reset)
+	timed->reset();
+}
+
+static void *lat_malloc_fn(size_t size)
+{
+    uint64_t t = now_ns();
+    void *p = timed->malloc(size);
+
+    lat_record(lat_malloc[my_id], now_ns() - t);
+    return p;
+}
+
+static void lat_free_fn(void *ptr, size_t size)
+{
+    uint64_t t = now_ns();
+
+    timed->free(ptr, size);
+    lat_record(lat_free[my_id], now_ns() - t);
+}
+
+static const struct mt_alloc lat_alloc = {
+    "timed", lat_reset, lat_malloc_fn, lat_free_fn
+};
+
+static int cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* print p50/p99/p99.9 of the logs of nthreads threads, then clear them */
+static void lat_print(struct lat_log **logs, int nthreads)
+{
+    uint32_t *all;
+    long n = 0, i;
+    int t;
+
+    for (t = 0; t < nthreads; t++)
+	n += logs[t]->n;
+    if (n == 0 || (all = malloc(n * sizeof(uint32_t))) == NULL) {
+	printf(" %6s %6s %7s", "-", "-", "-");
+	return;
+    }
+    for (t = 0, i = 0; t < nthreads; t++) {
+	memcpy(all + i, logs[t]->ns, logs[t]->n * sizeof(uint32_t));
+	i += logs[t]->n;
+	logs[t]->n = 0;
+    }
+    qsort(all, n, sizeof(uint32_t), cmp_u32);
+    printf(" %6u %6u %7u", all[n / 2], all[n * 99 / 100], all[n * 999 / 1000]);
+    free(all);
+}
+
+/*
+ * larson - replace random slots, then pass the slots to the next thread
+ */
+static void *larson_slots[MAX_THREADS][LARSON_SLOTS];
+static size_t larson_sizes[MAX_THREADS][LARSON_SLOTS];
+
+static void larson_setup(int nthreads)
+{
+    memset(larson_slots, 0, sizeof(larson_slots));
+}
+
+static long larson_thread(int id, int nthreads)
+{
+    uint32_t seed = 2463534242u + id;
+    long ops = 0, per_round = nops / LARSON_ROUNDS;
+    int r, i, k;
+
+    for (r = 0; r < LARSON_ROUNDS; r++) {
+	/* round r works on the slots thread id-r allocated into */
+	void **slots = larson_slots[(id + r) % nthreads];
+	size_t *sizes = larson_sizes[(id + r) % nthreads];
+
+	for (i = 0; i < per_round; i++) {
+	    k = rnd(&seed) % LARSON_SLOTS;
+	    A->free(slots[k], sizes[k]);
+	    sizes[k] = 8 + rnd(&seed) % 120;
+	    slots[k] = A->malloc(sizes[k]);
+	    ops++;
+	}
+	pthread_barrier_wait(&round_barrier);
+    }
+
+    for (k = 0; k < LARSON_SLOTS; k++) {
+	A->free(larson_slots[id][k], larson_sizes[id][k]);
+	larson_slots[id][k] = NULL;
+    }
+    return ops;
+}
+
+/*
+ * threadtest - allocate a batch of objects, then free them all
+ */
+static long threadtest_thread(int id, int nthreads)
+{
+    void *batch[TT_BATCH];
+    long ops = 0;
+    int i;
+
+    while (ops < nops) {
+	for (i = 0; i < TT_BATCH; i++)
+	    batch[i] = A->malloc(8 + (i & 63));
+	for (i = 0; i < TT_BATCH; i++)
+	    A->free(batch[i], 8 + (i & 63));
+	ops += TT_BATCH;
+    }
+    return ops;
+}
+
+/*
+ * xmalloc - producers allocate into a bounded queue, consumers free
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t notfull, notempty;
+    void *q[XM_QUEUE];
+    size_t qsize[XM_QUEUE];
+    int head, count;
+} xq = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	 PTHREAD_COND_INITIALIZER };
+
+static void xmalloc_setup(int nthreads)
+{
+    xq.head = xq.count = 0;
+}
+
+static long xmalloc_thread(int id, int nthreads)
+{
+    uint32_t seed = 88675123u + id;
+    long i;
+
+    if (nthreads == 1) {
+	/* nobody to hand off to; allocate and free in turn */
+	for (i = 0; i < nops; i++) {
+	    size_t size = 8 + rnd(&seed) % 120;
+
+	    A->free(A->malloc(size), size);
+	}
+	return nops;
+    }
+
+    /* even ids produce, odd ids consume; a trailing even id is idle */
+    if (id % 2 == 0 && id + 1 >= nthreads)
+	return 0;
+
+    for (i = 0; i < nops; i++) {
+	size_t size = 0;
+	void *p = NULL;
+
+	if (id % 2 == 0) {
+	    size = 8 + rnd(&seed) % 120;
+	    p = A->malloc(size);
+	}
+	pthread_mutex_lock(&xq.lock);
+	if (id % 2 == 0) {
+	    while (xq.count == XM_QUEUE)
+		pthread_cond_wait(&xq.notfull, &xq.lock);
+	    xq.q[(xq.head + xq.count) % XM_QUEUE] = p;
+	    xq.qsize[(xq.head + xq.count++) % XM_QUEUE] = size;
+	    pthread_cond_signal(&xq.notempty);
+	}
+	else {
+	    while (xq.count == 0)
+		pthread_cond_wait(&xq.notempty, &xq.lock);
+	    p = xq.q[xq.head];
+	    size = xq.qsize[xq.head];
+	    xq.head = (xq.head + 1) % XM_QUEUE;
+	    xq.count--;
+	    pthread_cond_signal(&xq.notfull);
+	}
+	pthread_mutex_unlock(&xq.lock);
+	if (id % 2)
+	    A->free(p, size);
+    }
+    return nops;
+}
+
+/*
+ * cache-scratch - write to objects of a size that packs several per line
+ */
+static void *scratch_objs[MAX_THREADS];
+
+static void scratch_setup(int nthreads)
+{
+    int i;
+
+    /* allocated back to back by one thread, so they likely share lines */
+    for (i = 0; i < nthreads; i++)
+	scratch_objs[i] = A->malloc(CS_OBJSIZE);
+}
+
+static long scratch_thread(int id, int nthreads)
+{
+    long ops = 0;
+    int i;
+
+    A->free(scratch_objs[id], CS_OBJSIZE);
+    while (ops < nops) {
+	volatile char *p = A->malloc(CS_OBJSIZE);
+
+	for (i = 0; i < CS_WRITES; i++)
+	    p[i % CS_OBJSIZE]++;
+	A->free((void *)p, CS_OBJSIZE);
+	ops += CS_WRITES;
+    }
+    return ops;
+}
+
+/*
+ * burst - allocate a burst of tiny objects, touch each, free them all
+ */
+static long burst_thread(int id, int nthreads)
+{
+    uint32_t seed = 88675123u + id;
+    char *burst[BURST_OBJS];
+    size_t sizes[BURST_OBJS];
+    long ops = 0;
+    int i;
+
+    while (ops < nops) {
+	for (i = 0; i < BURST_OBJS; i++) {
+	    sizes[i] = 8 + rnd(&seed) % (BURST_MAXSIZE - 7);
+	    if ((burst[i] = A->malloc(sizes[i])) == NULL) {
+		fprintf(stderr, "burst: out of memory\n");
+		exit(1);
+	    }
+	    burst[i][0] = i;
+	}
+	for (i = 0; i < BURST_OBJS; i++)
+	    A->free(burst[i], sizes[i]);
+	ops += BURST_OBJS;
+    }
+    return ops;
+}
+
+/*
+ * stress - small batches of stamped objects, checked before each free
+ */
+static long stress_thread(int id, int nthreads)
+{
+    uint32_t seed = 521288629u + id, seq = 0;
+    uint32_t *batch[ST_BATCH];
+    size_t sizes[ST_BATCH];
+    long ops = 0;
+    int i, n;
+
+    while (ops < nops) {
+	n = 1 + rnd(&seed) % ST_BATCH;
+	for (i = 0; i < n; i++) {
+	    sizes[i] = 8 + rnd(&seed) % (ST_MAXSIZE - 7);
+	    if ((batch[i] = A->malloc(sizes[i])) == NULL) {
+		fprintf(stderr, "stress: out of memory\n");
+		exit(1);
+	    }
+	    batch[i][0] = id;
+	    batch[i][1] = seq + i;
+	}
+	for (i = 0; i < n; i++) {
+	    if (batch[i][0] != id || batch[i][1] != seq + i) {
+		fprintf(stderr, "stress: thread %d object %p handed out twice\n",
+			id, (void *)batch[i]);
+		exit(1);
+	    }
+	    A->free(batch[i], sizes[i]);
+	}
+	seq += n;
+	ops += n;
+    }
+    return ops;
+}
+
+static const struct workload workloads[] = {
+    { "larson", larson_setup, larson_thread },
+    { "threadtest", NULL, threadtest_thread },
+    { "xmalloc", xmalloc_setup, xmalloc_thread },
+    { "cache-scratch", scratch_setup, scratch_thread },
+    { "burst", NULL, burst_thread },
+    { "stress", NULL, stress_thread },
+};
+
+/*
+ * Driver
+ */
+static const struct workload *W;
+static int run_nthreads;
+static long thread_ops[MAX_THREADS];
+static double thread_start[MAX_THREADS], thread_end[MAX_THREADS];
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *thread_main(void *vargp)
+{
+    int id = (int)(intptr_t)vargp;
+
+    my_id = id;
+    pthread_barrier_wait(&barrier);
+    /* timed by the workers, main may be scheduled late off the barrier */
+    thread_start[id] = now();
+    thread_ops[id] = W->thread(id, run_nthreads);
+    thread_end[id] = now();
+    return NULL;
+}
+
+/* resident set size in KB, from /proc/self/status */
+static long rss_kb(const char *field)
+{
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(field);
+    FILE *f = fopen("/proc/self/status", "r");
+
+    if (f == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), f))
+	if (strncmp(line, field, len) == 0) {
+	    kb = atol(line + len + 1);
+	    break;
+	}
+    fclose(f);
+    return kb;
+}
+
+static void run(int nthreads)
+{
+    pthread_t tid[MAX_THREADS];
+    double start, end;
+    long ops = 0;
+    int i;
+
+    if (A->reset)
+	A->reset();
+    run_nthreads = nthreads;
+    if (W->setup)
+	W->setup(nthreads);
+    pthread_barrier_init(&barrier, NULL, nthreads + 1);
+    pthread_barrier_init(&round_barrier, NULL, nthreads);
+
+    for (i = 0; i < nthreads; i++)
+	pthread_create(&tid[i], NULL, thread_main, (void *)(intptr_t)i);
+    pthread_barrier_wait(&barrier);
+    for (i = 0; i < nthreads; i++)
+	pthread_join(tid[i], NULL);
+    start = thread_start[0];
+    end = thread_end[0];
+    for (i = 0; i < nthreads; i++) {
+	ops += thread_ops[i];
+	start = thread_start[i] < start ? thread_start[i] : start;
+	end = thread_end[i] > end ? thread_end[i] : end;
+    }
+    pthread_barrier_destroy(&barrier);
+    pthread_barrier_destroy(&round_barrier);
+
+    printf("%-8s %-14s %3d %14.0f %10ld %10ld", timed ? timed->name : A->name,
+	   W->name, nthreads, ops / (end - start), rss_kb("VmRSS:"),
+	   rss_kb("VmHWM:"));
+    if (timed) {
+	lat_print(lat_malloc, nthreads);
+	lat_print(lat_free, nthreads);
+    }
+    printf("\n");
+}
+
+/*
+ * Local/remote bandwidth
+ */
+
+/* pin the calling thread to the CPUs of node, from sysfs ("0-3,8-11") */
+static int pin_node(int node)
+{
+    char path[64], buf[1024], *s = buf;
+    cpu_set_t set;
+    FILE *f;
+
+    sprintf(path, "/sys/devices/system/node/node%d/cpulist", node);
+    if ((f = fopen(path, "r")) == NULL)
+	return -1;
+    if (fgets(buf, sizeof(buf), f) == NULL)
+	buf[0] = '\0';
+    fclose(f);
+
+    CPU_ZERO(&set);
+    while (*s >= '0' && *s <= '9') {
+	int lo = strtol(s, &s, 10), hi = lo;
+
+	if (*s == '-')
+	    hi = strtol(s + 1, &s, 10);
+	while (lo <= hi)
+	    CPU_SET(lo++, &set);
+	if (*s == ',')
+	    s++;
+    }
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static volatile long bw_sink;   /* keeps the read loop */
+
+static void bandwidth(void)
+{
+    int nodes, cpu, mem, i;
+
+    numa_reset();
+    nodes = mm_numa_nodes();
+    printf("%-10s %-6s", "cpu\\mem", "op");
+    for (mem = 0; mem < nodes; mem++)
+	printf(" %8d", mem);
+    printf("\n");
+
+    for (cpu = 0; cpu < nodes; cpu++) {
+	double wr[MAX_THREADS], rd[MAX_THREADS];
+
+	if (pin_node(cpu) != 0)
+	    fprintf(stderr, "cannot pin to node %d, unpinned\n", cpu);
+	for (mem = 0; mem < nodes; mem++) {
+	    long *buf = mm_numa_malloc_node(BW_SIZE, mem);
+	    long sum = 0;
+	    double t;
+	    size_t j;
+
+	    if (buf == NULL) {
+		wr[mem] = rd[mem] = -1;
+		continue;
+	    }
+	    memset(buf, 0, BW_SIZE);    /* fault in before timing */
+	    t = now();
+	    for (i = 0; i < BW_PASSES; i++)
+		memset(buf, i, BW_SIZE);
+	    wr[mem] = (double)BW_PASSES * BW_SIZE / (now() - t) / 1e9;
+	    t = now();
+	    for (i = 0; i < BW_PASSES; i++)
+		for (j = 0; j < BW_SIZE / sizeof(long); j++)
+		    sum += buf[j];
+	    bw_sink = sum;
+	    rd[mem] = (double)BW_PASSES * BW_SIZE / (now() - t) / 1e9;
+	    mm_numa_free(buf);
+	}
+	printf("%-10d %-6s", cpu, "write");
+	for (mem = 0; mem < nodes; mem++)
+	    printf(" %8.2f", wr[mem]);
+	printf("\n%-10s %-6s", "", "read");
+	for (mem = 0; mem < nodes; mem++)
+	    printf(" %8.2f", rd[mem]);
+	printf("\n");
+    }
+}
+
+/*
+ * shm_child - Leave SHM_BLOCKS blocks in the shared heap, each holding its
+ *             size and then child id's byte, and their offsets in offs;
+ *             as many again are freed along the way, some to the cache
+ */
+static void shm_child(mm_shm_t *h, uint64_t *offs, int id)
+{
+    uint32_t s = id + 1;
+    size_t size;
+    char *p;
+    int j;
+
+    for (j = 0; j < SHM_BLOCKS; j++) {
+	mm_shm_free(h, mm_shm_malloc(h, rnd(&s) % SHM_MAXSIZE + 1));
+	size = rnd(&s) % SHM_MAXSIZE + sizeof(uint32_t);
+	if ((p = mm_shm_malloc(h, size)) == NULL)
+	    _exit(1);
+	*(uint32_t *)p = size;
+	memset(p + sizeof(uint32_t), id + 1, size - sizeof(uint32_t));
+	offs[j] = mm_shm_off(h, p);
+    }
+    mm_shm_detach(h);
+    _exit(0);
+}
+
+/*
+ * shm_procs - Test mm_shm.c across nprocs processes, and recovery from
+ *             a process that dies holding the lock; 0 if all is well
+ */
+static int shm_procs(int nprocs)
+{
+    mm_shm_t *h = mm_shm_create(NULL, SHM_REGION);
+    uint64_t *offs, *fill;
+    int i, j, k, status, bad = 0;
+    pid_t pid;
+    char *p;
+
+    if (h == NULL
+	|| (offs = mm_shm_malloc(h, nprocs * SHM_BLOCKS * sizeof(*offs))) == NULL
+	|| (fill = malloc(SHM_FILL * sizeof(*fill))) == NULL) {
+	fprintf(stderr, "mm_shm: cannot set up the shared heap\n");
+	return 1;
+    }
+
+    /* cross-process: children allocate, the parent checks and frees */
+    for (i = 0; i < nprocs; i++)
+	if ((pid = fork()) == 0)
+	    shm_child(h, offs + i * SHM_BLOCKS, i);
+    for (i = 0; i < nprocs; i++)
+	if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))
+	    bad = 1;
+    for (i = 0; i < nprocs * SHM_BLOCKS && !bad; i++) {
+	p = mm_shm_ptr(h, offs[i]);
+	for (j = sizeof(uint32_t); j < *(uint32_t *)p; j++)
+	    if (p[j] != (char)(i / SHM_BLOCKS + 1))
+		bad = 1;
+	mm_shm_free(h, p);
+    }
+    if (bad || mm_shm_checkheap(h, 0)) {
+	printf("mm_shm: %d processes: blocks lost or overwritten\n", nprocs);
+	return 1;
+    }
+    printf("mm_shm: %d processes left %d blocks, parent freed them: ok\n",
+	   nprocs, nprocs * SHM_BLOCKS);
+
+    /* dead owner: a child spends nearly all its time under the lock
+       searching for a fit bigger than the heap, and is killed there */
+    for (i = 0; i < SHM_FILL; i++)
+	if ((p = mm_shm_malloc(h, 24)) != NULL)
+	    fill[i] = mm_shm_off(h, p);
+    for (k = 1; k <= SHM_KILLS && mm_shm_recoveries(h) == 0; k++) {
+	if ((pid = fork()) == 0)
+	    for (;;)
+		mm_shm_malloc(h, mm_shm_size(h));
+	usleep(20000);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	if ((p = mm_shm_malloc(h, 1000)) == NULL) {
+	    printf("mm_shm: no malloc after a child was killed\n");
+	    return 1;
+	}
+	mm_shm_free(h, p);
+    }
+    for (i = 0; i < SHM_FILL; i++)
+	mm_shm_free(h, mm_shm_ptr(h, fill[i]));
+    if (mm_shm_recoveries(h) == 0) {
+	printf("mm_shm: no child died holding the lock in %d tries\n", SHM_KILLS);
+	return 1;
+    }
+    /* the frees went through too: the heap is one free block again */
+    if (mm_shm_checkheap(h, 0)
+	|| (p = mm_shm_malloc(h, SHM_REGION / 2)) == NULL) {
+	printf("mm_shm: heap inconsistent after recovery\n");
+	return 1;
+    }
+    mm_shm_free(h, p);
+    printf("mm_shm: child killed holding the lock (try %d), recovered: ok\n",
+	   k - 1);
+    free(fill);
+    mm_shm_detach(h);
+    return 0;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "usage: %s [-a alloc] [-w workload] [-t maxthreads] [-n ops] [-l] [-B]\n"
+	    "       %s -S [-t procs]\n", prog, prog);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    const char *aname = "mm", *wname = NULL;
+    int maxthreads = 8, latency = 0, shm = 0, c, i, t;
+
+    while ((c = getopt(argc, argv, "a:w:t:n:lBS")) != -1) {
+	switch (c) {
+	case 'a': aname = optarg; break;
+	case 'w': wname = optarg; break;
+	case 't': maxthreads = atoi(optarg); break;
+	case 'n': nops = atol(optarg); break;
+	case 'l': latency = 1; break;
+	case 'B': bandwidth(); return 0;
+	case 'S': shm = 1; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (maxthreads < 1 || maxthreads > MAX_THREADS)
+	usage(argv[0]);
+    if (shm)
+	return shm_procs(maxthreads);
+
+    for (i = 0; i < sizeof(allocs)/sizeof(allocs[0]); i++)
+	if (strcmp(allocs[i].name, aname) == 0)
+	    A = &allocs[i];
+    if (A == NULL)
+	usage(argv[0]);
+    if (latency) {
+	for (i = 0; i < maxthreads; i++)
+	    if ((lat_malloc[i] = calloc(1, sizeof(struct lat_log))) == NULL
+		|| (lat_free[i] = calloc(1, sizeof(struct lat_log))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	    }
+	timed = A;
+	A = &lat_alloc;
+    }
+
+    mem_init();
+    printf("%-8s %-14s %3s %14s %10s %10s", "alloc", "workload", "thr",
+	   "ops/s", "rss(KB)", "peak(KB)");
+    if (latency)
+	printf(" %6s %6s %7s %6s %6s %7s", "m-p50", "m-p99", "m-p999",
+	       "f-p50", "f-p99", "f-p999");
+    printf("\n");
+    for (i = 0; i < sizeof(workloads)/sizeof(workloads[0]); i++) {
+	W = &workloads[i];
+	if (wname && strcmp(W->name, wname) != 0)
+	    continue;
+	for (t = 1; t <= maxthreads; t *= 2)
+	    run(t);
+    }
+    mm_bg_stop();   /* no-op unless bg ran */
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * pmrbench.cpp - std::vector / std::unordered_map / std::map workloads
+ *                through the mm.c adapters in mm_pmr.hpp, against the
+ *                default allocator
+ *
+ * mm::shm_resource runs over an anonymous mm_shm.c region of SHM_REGION
+ * bytes, which is checked (mm_shm_checkheap) once every run is done.
+ *
+ * usage: pmrbench [-n elements] [-r rounds]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+
+#include "mm_pmr.hpp"
+
+extern "C" {
+#include "memlib.h"
+}
+
+#define SHM_REGION (64 << 20)   /* bytes in the shm_resource region */
+
+static int nelems = 50000;
+static int rounds = 10;
+
+template <class Vec>
+static long vector_work(Vec v)
+{
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+	v.clear();
+	v.shrink_to_fit();
+	for (int i = 0; i < nelems; i++)
+	    v.push_back(i);
+	sum += v[v.size() / 2];
+    }
+    return sum;
+}
+
+template <class Map>
+static long map_work(Map m)
+{
+    long sum = 0;
+    for (int r = 0; r < rounds; r++) {
+	for (int i = 0; i < nelems; i++)
+	    m.emplace((i * 7919) % (nelems * 2), i);
+	for (int i = 0; i < nelems; i += 2)
+	    m.erase((i * 7919) % (nelems * 2));
+	for (int i = 0; i < nelems; i++) {
+	    auto it = m.find(i);
+	    if (it != m.end())
+		sum += it->second;
+	}
+	m.clear();
+    }
+    return sum;
+}
+
+/* fresh mm.c heap for every run, so runs do not see each other's garbage */
+static void reset_heap()
+{
+    mem_reset_brk();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mm_init failed\n");
+	exit(1);
+    }
+}
+
+static void run(const char *workload, const char *alloc, const std::function<long()> &f)
+{
+    reset_heap();
+    auto t0 = std::chrono::steady_clock::now();
+    volatile long sink = f();
+    auto t1 = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    (void)sink;
+    printf("%-14s %-22s %10.3f ms %12.0f ops/s\n", workload, alloc,
+	   secs * 1e3, (double)nelems * rounds / secs);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+
+    while ((c = getopt(argc, argv, "n:r:")) != -1) {
+	switch (c) {
+	case 'n': nelems = atoi(optarg); break;
+	case 'r': rounds = atoi(optarg); break;
+	default:
+	    fprintf(stderr, "usage: %s [-n elements] [-r rounds]\n", argv[0]);
+	    return 1;
+	}
+    }
+
+    mem_init();
+    mm_shm_t *h = mm_shm_create(NULL, SHM_REGION);
+    if (h == NULL) {
+	fprintf(stderr, "mm_shm_create failed\n");
+	return 1;
+    }
+    mm::shm_resource shm(h);
+
+    using kv = std::pair<const int, int>;
+
+    run("vector", "std::allocator", [] { return vector_work(std::vector<int>()); });
+    run("vector", "mm::allocator",
+	[] { return vector_work(std::vector<int, mm::allocator<int>>()); });
+    run("vector", "pmr new_delete",
+	[] { return vector_work(std::pmr::vector<int>(std::pmr::new_delete_resource())); });
+    run("vector", "pmr mm::heap",
+	[] { return vector_work(std::pmr::vector<int>(mm::heap())); });
+    run("vector", "pmr mm::shm_resource",
+	[&] { return vector_work(std::pmr::vector<int>(&shm)); });
+
+    run("unordered_map", "std::allocator",
+	[] { return map_work(std::unordered_map<int, int>()); });
+    run("unordered_map", "mm::allocator",
+	[] { return map_work(std::unordered_map<int, int, std::hash<int>,
+			     std::equal_to<int>, mm::allocator<kv>>()); });
+    run("unordered_map", "pmr new_delete",
+	[] { return map_work(std::pmr::unordered_map<int, int>(std::pmr::new_delete_resource())); });
+    run("unordered_map", "pmr mm::heap",
+	[] { return map_work(std::pmr::unordered_map<int, int>(mm::heap())); });
+    run("unordered_map", "pmr mm::shm_resource",
+	[&] { return map_work(std::pmr::unordered_map<int, int>(&shm)); });
+
+    run("map", "std::allocator", [] { return map_work(std::map<int, int>()); });
+    run("map", "mm::allocator",
+	[] { return map_work(std::map<int, int, std::less<int>, mm::allocator<kv>>()); });
+    run("map", "pmr new_delete",
+	[] { return map_work(std::pmr::map<int, int>(std::pmr::new_delete_resource())); });
+    run("map", "pmr mm::heap",
+	[] { return map_work(std::pmr::map<int, int>(mm::heap())); });
+    run("map", "pmr mm::shm_resource",
+	[&] { return map_work(std::pmr::map<int, int>(&shm)); });
+
+    /* an over-aligned block takes the stash path through the region too */
+    void *p = shm.allocate(100, 64);
+    bool aligned = reinterpret_cast<std::uintptr_t>(p) % 64 == 0;
+    shm.deallocate(p, 100, 64);
+
+    int errors = mm_shm_checkheap(h, 0);
+    mm_shm_detach(h);
+    mem_deinit();
+    if (!aligned || errors) {
+	fprintf(stderr, "mm::shm_resource: %s\n",
+		aligned ? "shared heap inconsistent" : "block misaligned");
+	return 1;
+    }
+    return 0;
+}